@@ -0,0 +1,483 @@
+// Standalone microbenchmarks for the cache/directory model. Built without
+// Pin (see the bench target in the Makefile) and driven with synthetic
+// access patterns.
+
+#include "Cache.h"
+#include "Directory.h"
+#include "Latency.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Allocation accounting for everything run inside a timed region
+static unsigned long int allocCount = 0;
+static unsigned long int allocBytes = 0;
+
+void* operator new( size_t size )
+{
+   ++allocCount;
+   allocBytes += size;
+   void* p = malloc( size ? size : 1 );
+   if( p == nullptr )
+      throw bad_alloc();
+   return p;
+}
+
+void* operator new[]( size_t size )
+{
+   return operator new( size );
+}
+
+void operator delete( void* p ) noexcept
+{
+   free( p );
+}
+
+void operator delete[]( void* p ) noexcept
+{
+   free( p );
+}
+
+void operator delete( void* p, size_t ) noexcept
+{
+   free( p );
+}
+
+void operator delete[]( void* p, size_t ) noexcept
+{
+   free( p );
+}
+
+const unsigned int NUM_THREADS = 4;
+const uintptr_t    BASE_ADDR   = 0x10000000;
+
+struct Access
+{
+   uintptr_t        addr;
+   unsigned int     length;
+   unsigned int     tid;
+   Cache::AccessType type;
+   bool             range;
+};
+
+typedef vector<Access> Trace;
+
+struct Geometry
+{
+   size_t       cacheSize;
+   size_t       lineSize;
+   unsigned int assoc;
+};
+
+static const Geometry geometries[] =
+{
+   {  32*KILO, 64,  8 },
+   { 256*KILO, 64,  8 },
+   {   2*MEGA, 64, 16 },
+};
+
+static long peakRssKb()
+{
+   struct rusage usage;
+   getrusage( RUSAGE_SELF, &usage );
+   return usage.ru_maxrss;
+}
+
+static void push( Trace& t, unsigned int tid, Cache::AccessType type, uintptr_t addr, unsigned int length, bool range = false )
+{
+   Access a;
+   a.addr   = addr;
+   a.length = length;
+   a.tid    = tid;
+   a.type   = type;
+   a.range  = range;
+   t.push_back( a );
+}
+
+// Each thread walks its own large private region with 8 byte loads
+static Trace streamTrace( size_t n )
+{
+   Trace t;
+   const uintptr_t region = 64*MEGA;
+   for( size_t i = 0; i < n; ++i )
+   {
+      unsigned int tid = i % NUM_THREADS;
+      uintptr_t offset = ((i / NUM_THREADS) * 8) % region;
+      push( t, tid, Cache::Load, BASE_ADDR + tid*region + offset, 8 );
+   }
+   return t;
+}
+
+// Uniformly random loads and stores over a shared region
+static Trace randomTrace( size_t n )
+{
+   Trace t;
+   mt19937_64 rng( 1 );
+   for( size_t i = 0; i < n; ++i )
+   {
+      unsigned int tid = rng() % NUM_THREADS;
+      uintptr_t addr = BASE_ADDR + ((rng() % (64*MEGA)) & ~uintptr_t(7));
+      push( t, tid, (rng() % 10 < 3) ? Cache::Store : Cache::Load, addr, 8 );
+   }
+   return t;
+}
+
+// Mostly loads to a small shared hot set, with occasional cold accesses
+static Trace hotSetTrace( size_t n )
+{
+   Trace t;
+   mt19937_64 rng( 2 );
+   for( size_t i = 0; i < n; ++i )
+   {
+      unsigned int tid = rng() % NUM_THREADS;
+      uintptr_t addr;
+      if( rng() % 10 < 9 )
+         addr = BASE_ADDR + ((rng() % (16*KILO)) & ~uintptr_t(7));
+      else
+         addr = BASE_ADDR + 16*KILO + ((rng() % (64*MEGA)) & ~uintptr_t(7));
+      push( t, tid, (rng() % 100 < 2) ? Cache::Store : Cache::Load, addr, 8 );
+   }
+   return t;
+}
+
+// Pairs of threads hand a 4KB buffer back and forth
+static Trace producerConsumerTrace( size_t n )
+{
+   Trace t;
+   const uintptr_t bufSize = 4*KILO;
+   size_t i = 0;
+   for( unsigned int round = 0; i < n; ++round )
+   {
+      unsigned int producer = (2*round) % NUM_THREADS;
+      unsigned int consumer = producer + 1;
+      uintptr_t buf = BASE_ADDR + (round % 16) * bufSize;
+
+      for( uintptr_t off = 0; off < bufSize && i < n; off += 8, ++i )
+         push( t, producer, Cache::Store, buf + off, 8 );
+      for( uintptr_t off = 0; off < bufSize && i < n; off += 8, ++i )
+         push( t, consumer, Cache::Load, buf + off, 8 );
+   }
+   return t;
+}
+
+// Every thread stores to its own word of the same few lines
+static Trace pingPongTrace( size_t n )
+{
+   Trace t;
+   for( size_t i = 0; i < n; ++i )
+   {
+      unsigned int tid = i % NUM_THREADS;
+      uintptr_t line = (i / NUM_THREADS) % 4;
+      push( t, tid, Cache::Store, BASE_ADDR + line*64 + tid*8, 8 );
+   }
+   return t;
+}
+
+// Wide accesses straddling line boundaries
+static Trace unalignedTrace( size_t n )
+{
+   Trace t;
+   mt19937_64 rng( 3 );
+   static const unsigned int lengths[] = { 16, 32, 64, 256 };
+   for( size_t i = 0; i < n; ++i )
+   {
+      unsigned int tid = i % NUM_THREADS;
+      unsigned int length = lengths[rng() % 4];
+      uintptr_t addr = BASE_ADDR + tid*MEGA + ((i / NUM_THREADS) * 64) % MEGA + 60;
+      push( t, tid, (rng() % 4 == 0) ? Cache::Store : Cache::Load, addr, length );
+   }
+   return t;
+}
+
+// REP MOVS style copies: one range load and one range store per copy
+// Sized so that the copies touch about n 64-byte lines in total
+static Trace memcpyTrace( size_t n )
+{
+   Trace t;
+   mt19937_64 rng( 6 );
+   static const unsigned int lengths[] = { 256, 4*KILO, 64*KILO };
+   for( size_t lines = 0; lines < n; )
+   {
+      unsigned int tid = rng() % NUM_THREADS;
+      unsigned int length = lengths[rng() % 3];
+      uintptr_t src = BASE_ADDR + (rng() % (16*MEGA));
+      uintptr_t dst = BASE_ADDR + 16*MEGA + (rng() % (16*MEGA));
+      push( t, tid, Cache::Load, src, length, true );
+      push( t, tid, Cache::Store, dst, length, true );
+      lines += 2*length/64;
+   }
+   return t;
+}
+
+struct Pattern
+{
+   const char* name;
+   Trace (*generate)( size_t n );
+};
+
+static const Pattern patterns[] =
+{
+   { "stream",    streamTrace },
+   { "random",    randomTrace },
+   { "hotset",    hotSetTrace },
+   { "prodcons",  producerConsumerTrace },
+   { "pingpong",  pingPongTrace },
+   { "unaligned", unalignedTrace },
+   { "memcpy",    memcpyTrace },
+};
+
+static void printHeader()
+{
+   cout << left << setw(28) << "Benchmark" << right
+        << setw(12) << "Ops"
+        << setw(12) << "ns/op"
+        << setw(12) << "Allocs"
+        << setw(14) << "Alloc Bytes"
+        << setw(14) << "Peak RSS KB"
+        << endl;
+}
+
+// The body runs in a forked child so that the peak RSS reported belongs
+// to this benchmark alone, not to the largest one run so far
+template <typename F>
+static void run( const string& name, size_t ops, F body )
+{
+   cout.flush();
+   pid_t pid = fork();
+   if( pid < 0 )
+   {
+      cerr << "fork failed, skipping " << name << endl;
+      return;
+   }
+
+   if( pid != 0 )
+   {
+      int status;
+      waitpid( pid, &status, 0 );
+      return;
+   }
+
+   allocCount = 0;
+   allocBytes = 0;
+
+   auto start = chrono::steady_clock::now();
+   body();
+   auto stop = chrono::steady_clock::now();
+
+   unsigned long int allocs = allocCount;
+   unsigned long int bytes  = allocBytes;
+
+   double ns = chrono::duration<double,nano>(stop - start).count();
+
+   cout << left << setw(28) << name << right
+        << setw(12) << ops
+        << setw(12) << fixed << setprecision(2) << ns/ops
+        << setw(12) << allocs
+        << setw(14) << bytes
+        << setw(14) << peakRssKb()
+        << endl;
+
+   cout.flush();
+   _exit( 0 );
+}
+
+static void benchPattern( const Pattern& p, const Geometry& g, size_t n, const LatencyModel* latency )
+{
+   Trace trace = p.generate( n );
+
+   DirectorySet directorySet( 2, g.lineSize );
+   directorySet.setLatencyModel( latency );
+   vector<Cache*> caches;
+   for( unsigned int i = 0; i < NUM_THREADS; ++i )
+      caches.push_back( new Cache(g.cacheSize, g.lineSize, g.assoc, &directorySet) );
+
+   // A range access counts once per line it touches
+   size_t ops = 0;
+   for( auto it = trace.begin(); it != trace.end(); ++it )
+   {
+      if( it->range )
+         ops += (it->addr + it->length - 1)/g.lineSize - it->addr/g.lineSize + 1;
+      else
+         ++ops;
+   }
+
+   string name = string(p.name) + "/" + to_string(g.cacheSize/KILO) + "K-" + to_string(g.assoc) + "w";
+   run( name, ops, [&]()
+   {
+      for( auto it = trace.begin(); it != trace.end(); ++it )
+      {
+         if( it->range )
+            caches[it->tid]->accessRange( it->type, it->addr, it->length );
+         else
+            caches[it->tid]->access( it->type, it->addr, it->length );
+      }
+   });
+
+   for( auto it = caches.begin(); it != caches.end(); ++it )
+      delete *it;
+}
+
+// Directory::request in isolation: allocate then evict each line from a
+// single cache so that no downgrades are sent
+static void benchDirectoryRequest( size_t n )
+{
+   DirectorySet directorySet( 1, 64 );
+   Cache cache( 32*KILO, 64, 8, &directorySet );
+   Directory& dir = directorySet.find( BASE_ADDR );
+
+   mt19937_64 rng( 4 );
+   vector<uintptr_t> addrs;
+   for( size_t i = 0; i < n/2; ++i )
+      addrs.push_back( BASE_ADDR + (rng() % (256*MEGA)) * 64 );
+
+   run( "Directory::request", 2*addrs.size(), [&]()
+   {
+      for( auto it = addrs.begin(); it != addrs.end(); ++it )
+      {
+         SharerLocation loc = { static_cast<uint16_t>(cache.id()), 0, 0 };
+         DirectoryEntry* entry = nullptr;
+         dir.request( &cache, *it, Shared, loc, entry );
+         dir.evict( entry, loc );
+      }
+   });
+}
+
+static void benchDirectorySetFind( size_t n )
+{
+   DirectorySet directorySet( 2, 64 );
+
+   mt19937_64 rng( 5 );
+   vector<uintptr_t> addrs;
+   for( size_t i = 0; i < n; ++i )
+      addrs.push_back( BASE_ADDR + rng() % (1024*MEGA) );
+
+   uintptr_t sink = 0;
+   run( "DirectorySet::find", addrs.size(), [&]()
+   {
+      for( auto it = addrs.begin(); it != addrs.end(); ++it )
+         sink += reinterpret_cast<uintptr_t>( &directorySet.find(*it) );
+   });
+
+   if( sink == 1 )
+      cout << endl;
+}
+
+// Lookup and LRU update on their own, outside the access path. The lookup
+// runs on a full cache and half of the lookups miss.
+struct CacheBench
+{
+   static void find( const Geometry& g, size_t n )
+   {
+      DirectorySet directorySet( 1, g.lineSize );
+      Cache cache( g.cacheSize, g.lineSize, g.assoc, &directorySet );
+      size_t numLines = g.cacheSize / g.lineSize;
+      for( size_t i = 0; i < numLines; ++i )
+         cache.access( Cache::Load, BASE_ADDR + i*g.lineSize, 1 );
+
+      mt19937_64 rng( 6 );
+      vector<uintptr_t> addrs;
+      for( size_t i = 0; i < n; ++i )
+         addrs.push_back( BASE_ADDR + (rng() % (2*numLines)) * g.lineSize );
+
+      uintptr_t sink = 0;
+      run( "Cache::_find/" + _suffix(g), addrs.size(), [&]()
+      {
+         for( auto it = addrs.begin(); it != addrs.end(); ++it )
+         {
+            unsigned int set = (*it & cache._setMask) >> cache._setShift;
+            uintptr_t tag    = (*it & cache._tagMask) >> cache._tagShift;
+            sink += reinterpret_cast<uintptr_t>( cache._find(set, tag) );
+         }
+      });
+
+      if( sink == 1 )
+         cout << endl;
+   }
+
+   static void updateLru( const Geometry& g, size_t n )
+   {
+      DirectorySet directorySet( 1, g.lineSize );
+      Cache cache( g.cacheSize, g.lineSize, g.assoc, &directorySet );
+
+      mt19937_64 rng( 7 );
+      vector<pair<unsigned int,unsigned int> > uses;
+      for( size_t i = 0; i < n; ++i )
+         uses.push_back( make_pair(rng() % cache._sets, rng() % cache._assoc) );
+
+      run( "Cache::_updateLru/" + _suffix(g), uses.size(), [&]()
+      {
+         for( auto it = uses.begin(); it != uses.end(); ++it )
+            cache._updateLru( it->first, &cache._lines[it->first][it->second] );
+      });
+   }
+
+private:
+   static string _suffix( const Geometry& g )
+   {
+      return to_string(g.cacheSize/KILO) + "K-" + to_string(g.assoc) + "w";
+   }
+};
+
+int main( int argc, char* argv[] )
+{
+   size_t n = 2000000;
+   string filter;
+   LatencyModel latency;
+   bool useLatency = false;
+
+   for( int i = 1; i < argc; ++i )
+   {
+      if( strcmp(argv[i], "-n") == 0 && i+1 < argc )
+         n = strtoul( argv[++i], nullptr, 0 );
+      else if( strcmp(argv[i], "-f") == 0 && i+1 < argc )
+         filter = argv[++i];
+      else if( strcmp(argv[i], "-l") == 0 )
+         useLatency = true;
+      else
+      {
+         cerr << "Usage: " << argv[0] << " [-n accesses] [-f name-filter] [-l]" << endl;
+         return -1;
+      }
+   }
+
+   printHeader();
+
+   for( const Pattern& p : patterns )
+   {
+      if( !filter.empty() && string(p.name).find(filter) == string::npos )
+         continue;
+
+      for( const Geometry& g : geometries )
+         benchPattern( p, g, n, useLatency ? &latency : nullptr );
+   }
+
+   if( filter.empty() || string("Directory::request").find(filter) != string::npos )
+      benchDirectoryRequest( n );
+
+   if( filter.empty() || string("DirectorySet::find").find(filter) != string::npos )
+      benchDirectorySetFind( n );
+
+   for( const Geometry& g : geometries )
+   {
+      if( filter.empty() || string("Cache::_find").find(filter) != string::npos )
+         CacheBench::find( g, n );
+
+      if( filter.empty() || string("Cache::_updateLru").find(filter) != string::npos )
+         CacheBench::updateLru( g, n );
+   }
+
+   return 0;
+}
@@ -1,7 +1,10 @@
 #include "Cache.h"
 #include "Util.h"
 #include "Directory.h"
+#include "Checkpoint.h"
+#include "Latency.h"
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 
@@ -11,7 +14,8 @@ Cache::Cache( size_t cacheSize,
               size_t lineSize, 
               unsigned int assoc, 
               DirectorySet* directorySet )
- : _directorySet(directorySet)
+ : _directorySet(directorySet),
+   _latency(directorySet->latencyModel())
 {
    assert( cacheSize != 0 );
    assert( lineSize != 0 );
@@ -29,6 +33,8 @@ Cache::Cache( size_t cacheSize,
    _tagShift   = _setShift + floorLog2(_sets);
    _tagMask    = ~(_setMask | _offsetMask);
 
+   _id = _directorySet->addCache( this );
+
    _lines = new CacheLine*[_sets];
    for( unsigned int s = 0; s < _sets; ++s )
    {
@@ -43,10 +49,31 @@ Cache::Cache( size_t cacheSize,
    _multilineAccesses = 0;
    _downgrades = 0;
    _rscFlush = 0;
+   _stallCycles = 0;
 }
 
 Cache::~Cache()
 {
+   // Hand back the directory's in-flight counts
+   drain();
+
+   // The directory must not send anything to a destroyed cache. Lines
+   // left unattached by a failed restore() have no directory entry.
+   for( unsigned int s = 0; s < _sets; ++s )
+   {
+      for( unsigned int w = 0; w < _assoc; ++w )
+      {
+         CacheLine& line = _lines[s][w];
+         if( line.state != Invalid && line.dirEntry != nullptr )
+         {
+            SharerLocation loc = { static_cast<uint16_t>(_id), static_cast<uint16_t>(w), s };
+            _home( line ).forget( line.dirEntry, loc );
+         }
+      }
+   }
+
+   _directorySet->removeCache( _id );
+
    for( unsigned int s = 0; s < _sets;  ++s )
    {
       delete [] _lines[s];
@@ -56,14 +83,101 @@ Cache::~Cache()
 }
 
 bool Cache::access( AccessType type, uintptr_t addr, size_t length )
+{
+   unsigned int set = (addr & _setMask) >> _setShift;
+   uintptr_t tag    = (addr & _tagMask) >> _tagShift;
+
+   return _access( type, addr, length, set, tag );
+}
+
+bool Cache::_access( AccessType type,
+                     uintptr_t addr,
+                     size_t length,
+                     unsigned int set,
+                     uintptr_t tag )
+{
+   if( !_mailbox.empty() )
+      drain();
+
+   Directory* home = nullptr;
+   bool hit = _accessLine( type, addr, set, tag, home );
+
+   // Check if more lines need to be accessed. Like the original recursive
+   // walk, stop after the first line that does not hit.
+   uintptr_t endAddr = addr + length - 1;
+   unsigned int endSet = (endAddr & _setMask) >> _setShift;
+   while( endSet != set )
+   {
+      ++_multilineAccesses;
+      if( !hit )
+         break;
+
+      uintptr_t nextLine = (addr & ~_offsetMask) + _lineSize;
+      if( (nextLine & (PAGE_SIZE - 1)) == 0 )
+         home = nullptr;
+
+      addr = nextLine;
+      set  = (addr & _setMask) >> _setShift;
+      tag  = (addr & _tagMask) >> _tagShift;
+      hit  = _accessLine( type, addr, set, tag, home );
+   }
+
+   return hit;
+}
+
+bool Cache::accessRange( AccessType type, uintptr_t addr, size_t length )
+{
+   if( !_mailbox.empty() )
+      drain();
+
+   if( length == 0 )
+      return true;
+
+   uintptr_t lineAddr = addr & ~_offsetMask;
+   uintptr_t endLine  = (addr + length - 1) & ~_offsetMask;
+
+   unsigned int set = (lineAddr & _setMask) >> _setShift;
+   uintptr_t tag    = (lineAddr & _tagMask) >> _tagShift;
+
+   // Lines on the same page share a home site, so only look it up once
+   Directory* home = nullptr;
+   bool hit = true;
+
+   for( ;; )
+   {
+      hit = _accessLine( type, lineAddr, set, tag, home ) && hit;
+
+      if( lineAddr == endLine )
+         break;
+
+      ++_multilineAccesses;
+
+      lineAddr += _lineSize;
+      if( ++set == _sets )
+      {
+         set = 0;
+         ++tag;
+      }
+
+      if( (lineAddr & (PAGE_SIZE - 1)) == 0 )
+         home = nullptr;
+   }
+
+   return hit;
+}
+
+// Access a single line. home caches the Directory for addr's page across
+// calls and is filled in on the first directory request.
+bool Cache::_accessLine( AccessType type,
+                         uintptr_t addr,
+                         unsigned int set,
+                         uintptr_t tag,
+                         Directory*& home )
 {
    // Check for hit
    bool hit = false;
    bool partialHit = false;
 
-   unsigned int set = (addr & _setMask) >> _setShift;
-   uintptr_t tag    = (addr & _tagMask) >> _tagShift;
-
    CacheLine* targetLine = _find( set, tag );
    if( targetLine != nullptr )
    {
@@ -83,58 +197,90 @@ bool Cache::access( AccessType type, uintptr_t addr, size_t length )
 
       if( targetLine->safe )
          ++_safeAccesses;
+
+      if( _latency != nullptr )
+         _stallCycles += _latency->hit;
    }
    else
    {
-      // Directory request needed for anything other than full hit
-      bool safe;
-      Directory& dir = _directorySet->find( addr );
-      CacheState reqState = (type == Load) ? Shared : Modified;
-      CacheState repState = dir.request( this, addr, reqState, &safe );
-
-      assert( repState >= reqState );
-
+      // Directory request needed for anything other than full hit. The
+      // requested line goes in place of the existing copy on a partial hit,
+      // otherwise it replaces the LRU way.
+      unsigned int way;
       if( partialHit )
       {
-         assert( repState == Modified );
-         targetLine->state = repState;
-         targetLine->safe  = safe;
-         ++_partialHits;
+         way = targetLine - _lines[set];
       }
       else
       {
-         int lruWay = 0;
+         way = 0;
          int lruAge = 0;
          for( unsigned int w = 0; w < _assoc; ++w )
          {
             CacheLine& line = _lines[set][w];
             if( line.state == Invalid )
             {
-               lruWay = w;
+               way = w;
                break;
             }
 
             if( line.age > lruAge )
             {
-               lruWay = w;
+               way = w;
                lruAge = line.age;
             }
          }
+      }
+
+      bool safe;
+      if( partialHit )
+         home = &_home( *targetLine );
+      else if( home == nullptr )
+         home = &_directorySet->find( addr );
+
+      SharerLocation loc;
+      loc.cache = _id;
+      loc.way   = way;
+      loc.set   = set;
+
+      DirectoryEntry* entry = partialHit ? targetLine->dirEntry : nullptr;
+      CacheState reqState = (type == Load) ? Shared : Modified;
+      unsigned int sent;
+      uint16_t version;
+      CacheState repState = home->request( this, addr, reqState, loc, entry, &safe, &sent, &version );
+
+      assert( repState >= reqState );
+
+      if( _latency != nullptr )
+      {
+         unsigned long int cycles = home->hopLatency() + sent * _latency->invalidation;
+         _stallCycles += cycles;
+         if( sent != 0 )
+            _stallCount[addr >> _setShift] += cycles;
+      }
 
-         CacheLine& destLine = _lines[set][lruWay];
+      if( partialHit )
+      {
+         assert( repState == Modified );
+         targetLine->state   = repState;
+         targetLine->safe    = safe;
+         targetLine->version = version;
+         ++_partialHits;
+      }
+      else
+      {
+         CacheLine& destLine = _lines[set][way];
          targetLine = &destLine;
 
          // Tell directory about eviction
          if( destLine.state != Invalid )
-         {
-            uintptr_t evictAddr = destLine.tag << _tagShift;
-            evictAddr |= set << _setShift;
-            _directorySet->find( evictAddr ).request( this, evictAddr, Invalid );
-         }
+            _home( destLine ).evict( destLine.dirEntry, loc );
 
-         destLine.tag   = tag;
-         destLine.state = repState;
-         destLine.safe  = safe;
+         destLine.tag      = tag;
+         destLine.state    = repState;
+         destLine.safe     = safe;
+         destLine.version  = version;
+         destLine.dirEntry = entry;
 
          ++_misses;
       }
@@ -142,17 +288,6 @@ bool Cache::access( AccessType type, uintptr_t addr, size_t length )
 
    _updateLru( set, targetLine );
 
-   // Check if more lines need to be accessed
-   uintptr_t endAddr = addr + length - 1;
-   unsigned int endSet = (endAddr & _setMask) >> _setShift;
-   if( endSet != set )
-   {
-      uintptr_t nextSetBase = (addr & ~_offsetMask) + (1 << _setShift);
-      size_t curSetLen = _lineSize - (addr & _offsetMask);
-      hit = hit && access( type, nextSetBase, length-curSetLen );
-      ++_multilineAccesses;
-   }
-
    return hit;
 }
 
@@ -176,28 +311,80 @@ void Cache::_updateLru( unsigned int set, unsigned int usedWay )
    _lines[set][usedWay].age = 0;
 }
 
-void Cache::downgrade( uintptr_t addr, CacheState newState, bool safe )
+void Cache::drain()
 {
-   uintptr_t tag    = (addr & _tagMask) >> _tagShift;
-   unsigned int set = (addr & _setMask) >> _setShift;
+   DowngradeMessage* msg = _mailbox.takeAll();
+   while( msg != nullptr )
+   {
+      // _downgrade() hands msg back, which reuses next
+      DowngradeMessage* next = msg->next;
+      _downgrade( msg );
+      msg = next;
+   }
+}
 
-   CacheLine* targetLine = _find( set, tag );
+void Cache::downgrade( unsigned int set, unsigned int way, CacheState newState, bool safe )
+{
+   CacheLine* targetLine = &_lines[set][way];
+   assert( targetLine->state != Invalid );
+
+   _applyDowngrade( set, targetLine, newState, safe );
+}
+
+Directory& Cache::_home( const CacheLine& line ) const
+{
+   return _directorySet->site( line.dirEntry->site );
+}
 
-   assert( targetLine != nullptr );
+void Cache::_downgrade( DowngradeMessage* msg )
+{
+   CacheLine* targetLine = &_lines[msg->set][msg->way];
+
+   // Between posting and draining, the owner may already have evicted the
+   // copy the message names, and possibly re-requested the line. Drop the
+   // message unless (set, way) still holds a copy granted no later than
+   // the message was posted.
+   if( targetLine->state == Invalid ||
+       targetLine->dirEntry != msg->entry ||
+       static_cast<int16_t>(msg->version - targetLine->version) < 0 )
+   {
+      msg->home->acknowledge( msg );
+      return;
+   }
+
+   _applyDowngrade( msg->set, targetLine, msg->newState, msg->safe );
+
+   // Hands msg back to the home site, so it must not be used after this
+   msg->home->acknowledge( msg );
+}
+
+void Cache::_applyDowngrade( unsigned int set, CacheLine* targetLine, CacheState newState, bool safe )
+{
    assert( newState == Invalid || newState == Shared );
 
    // Reactive SC flush condition
+   uintptr_t lineAddr = (targetLine->tag << _tagShift) | (static_cast<uintptr_t>(set) << _setShift);
+
    if( targetLine->safe && !safe )
    {
       ++_rscFlush;
+
+      if( _latency != nullptr )
+      {
+         _stallCycles += _latency->rscFlush;
+         _stallCount[lineAddr >> _setShift] += _latency->rscFlush;
+      }
    }
 
    targetLine->state = newState;
    targetLine->safe  = safe;
 
+   if( newState == Invalid )
+      targetLine->dirEntry = nullptr;
+
    ++_downgrades;
 
-   _downgradeCount[addr >> _setShift]++;
+   _downgradeCount[lineAddr >> _setShift]++;
 }
 
 Cache::CacheLine* Cache::_find( unsigned int set, uintptr_t tag ) const
@@ -211,11 +398,168 @@ Cache::CacheLine* Cache::_find( unsigned int set, uintptr_t tag ) const
    return nullptr;
 }
 
-multimap<unsigned long int,uintptr_t> Cache::downgradeMap( unsigned int count ) const
+bool Cache::probe( uintptr_t addr, CacheState* state, bool* safe ) const
+{
+   unsigned int set = (addr & _setMask) >> _setShift;
+   uintptr_t tag    = (addr & _tagMask) >> _tagShift;
+
+   CacheLine* line = _find( set, tag );
+   if( line == nullptr )
+      return false;
+
+   *state = line->state;
+   *safe  = line->safe;
+   return true;
+}
+
+static void saveCounts( CheckpointWriter& writer, const map<uintptr_t,unsigned long int>& counts )
+{
+   writer.put<uint64_t>( counts.size() );
+   for( auto it = counts.begin(); it != counts.end(); ++it )
+   {
+      writer.put<uint64_t>( it->first );
+      writer.put<uint64_t>( it->second );
+   }
+}
+
+static void restoreCounts( CheckpointReader& reader, map<uintptr_t,unsigned long int>* counts )
+{
+   uint64_t size;
+   reader.get( &size );
+   counts->clear();
+   for( uint64_t i = 0; i < size && reader.ok(); ++i )
+   {
+      uint64_t line, count;
+      reader.get( &line );
+      reader.get( &count );
+      counts->emplace_hint( counts->end(), line, count );
+   }
+}
+
+void Cache::save( CheckpointWriter& writer ) const
+{
+   assert( _mailbox.empty() );
+
+   writer.put<uint32_t>( _sets );
+   writer.put<uint32_t>( _lineSize );
+   writer.put<uint32_t>( _assoc );
+
+   for( unsigned int s = 0; s < _sets; ++s )
+   {
+      for( unsigned int w = 0; w < _assoc; ++w )
+      {
+         const CacheLine& line = _lines[s][w];
+         writer.put<uint64_t>( line.tag );
+         writer.put<uint8_t>( line.state );
+         writer.put<uint8_t>( line.safe );
+         writer.put<int32_t>( line.age );
+      }
+   }
+
+   writer.put<uint64_t>( _misses );
+   writer.put<uint64_t>( _hits );
+   writer.put<uint64_t>( _partialHits );
+   writer.put<uint64_t>( _safeAccesses );
+   writer.put<uint64_t>( _multilineAccesses );
+   writer.put<uint64_t>( _downgrades );
+   writer.put<uint64_t>( _rscFlush );
+   writer.put<uint64_t>( _stallCycles );
+
+   saveCounts( writer, _downgradeCount );
+   saveCounts( writer, _stallCount );
+}
+
+bool Cache::restore( CheckpointReader& reader )
+{
+   uint32_t sets, lineSize, assoc;
+   reader.get( &sets );
+   reader.get( &lineSize );
+   reader.get( &assoc );
+   if( !reader.ok() || sets != _sets || lineSize != _lineSize || assoc != _assoc )
+      return false;
+
+   for( unsigned int s = 0; s < _sets; ++s )
+   {
+      for( unsigned int w = 0; w < _assoc; ++w )
+      {
+         CacheLine& line = _lines[s][w];
+         uint64_t tag;
+         uint8_t state, safe;
+         int32_t age;
+         reader.get( &tag );
+         reader.get( &state );
+         reader.get( &safe );
+         reader.get( &age );
+         if( state > Modified )
+            return false;
+
+         // A line may only be cached once per set
+         for( unsigned int v = 0; v < w && state != Invalid; ++v )
+         {
+            if( _lines[s][v].state != Invalid && _lines[s][v].tag == tag )
+               return false;
+         }
+
+         line.tag      = tag;
+         line.state    = static_cast<CacheState>(state);
+         line.safe     = safe;
+         line.age      = age;
+         line.dirEntry = nullptr;
+      }
+   }
+
+   uint64_t value;
+   reader.get( &value ); _misses            = value;
+   reader.get( &value ); _hits              = value;
+   reader.get( &value ); _partialHits       = value;
+   reader.get( &value ); _safeAccesses      = value;
+   reader.get( &value ); _multilineAccesses = value;
+   reader.get( &value ); _downgrades        = value;
+   reader.get( &value ); _rscFlush          = value;
+   reader.get( &value ); _stallCycles       = value;
+
+   restoreCounts( reader, &_downgradeCount );
+   restoreCounts( reader, &_stallCount );
+
+   return reader.ok();
+}
+
+bool Cache::attach( uintptr_t addr, unsigned int set, unsigned int way, DirectoryEntry* entry, CacheState* state )
+{
+   if( set != ((addr & _setMask) >> _setShift) || way >= _assoc )
+      return false;
+
+   // Each valid line belongs to exactly one directory entry
+   CacheLine& line = _lines[set][way];
+   if( line.state == Invalid || line.dirEntry != nullptr || line.tag != ((addr & _tagMask) >> _tagShift) )
+      return false;
+
+   line.dirEntry = entry;
+   *state = line.state;
+   return true;
+}
+
+bool Cache::allAttached() const
+{
+   for( unsigned int s = 0; s < _sets; ++s )
+   {
+      for( unsigned int w = 0; w < _assoc; ++w )
+      {
+         const CacheLine& line = _lines[s][w];
+         if( line.state != Invalid && line.dirEntry == nullptr )
+            return false;
+      }
+   }
+   return true;
+}
+
+// The count entries of counts with the highest values, keyed by value
+static multimap<unsigned long int,uintptr_t> topCounts( const map<uintptr_t,unsigned long int>& counts,
+                                                        unsigned int count )
 {
    multimap<unsigned long int,uintptr_t> topAddrs;
 
-   for( auto it = _downgradeCount.begin(); it != _downgradeCount.end(); ++it )
+   for( auto it = counts.begin(); it != counts.end(); ++it )
    {
       topAddrs.insert( make_pair(it->second,it->first) );
 
@@ -225,3 +569,13 @@ multimap<unsigned long int,uintptr_t> Cache::downgradeMap( unsigned int count )
 
    return topAddrs;
 }
+
+multimap<unsigned long int,uintptr_t> Cache::downgradeMap( unsigned int count ) const
+{
+   return topCounts( _downgradeCount, count );
+}
+
+multimap<unsigned long int,uintptr_t> Cache::stallMap( unsigned int count ) const
+{
+   return topCounts( _stallCount, count );
+}
@@ -6,13 +6,20 @@
 #include <iostream>
 #include <map>
 
+#include "Mailbox.h"
+
 const int KILO = 1024;
 const int MEGA = KILO*KILO;
 const int GIGA = KILO*MEGA;
 
+class Directory;
 class DirectorySet;
+struct DirectoryEntry;
+class CheckpointWriter;
+class CheckpointReader;
+struct LatencyModel;
 
-enum CacheState
+enum CacheState : uint8_t
 {
    Invalid,
    Shared,
@@ -20,8 +27,27 @@ enum CacheState
    Modified
 };
 
+// A downgrade on its way from a home site to the cache holding the copy
+// at (set, way). Messages are owned and recycled by the home site.
+struct DowngradeMessage
+{
+   DowngradeMessage* next;
+
+   Directory*      home;      // Sender, which the message goes back to
+   DirectoryEntry* entry;
+   uint32_t        set;
+   uint16_t        way;
+   CacheState      newState;
+   bool            safe;
+   uint16_t        version;   // DirectoryEntry::version when posted
+};
+
 class Cache
 {
+#ifdef CACHE_BENCH
+   // Bench.cpp times _find() and _updateLru() on their own
+   friend struct CacheBench;
+#endif
 public:
    enum AccessType
    {
@@ -32,12 +58,20 @@ public:
 private:
    struct CacheLine
    {
-      CacheLine() : tag(0), state(Invalid), age(0) {}
+      CacheLine() : tag(0), dirEntry(nullptr), age(0), state(Invalid), safe(false), version(0) {}
 
       uintptr_t tag;
-      CacheState state;
+
+      // Back-reference to the line's directory entry, which also names
+      // its home site
+      DirectoryEntry* dirEntry;
+
       int age;
+      CacheState state;
       bool safe;
+
+      // DirectoryEntry::version this copy was granted at
+      uint16_t version;
    };
 
 public:
@@ -49,28 +83,93 @@ public:
 
    bool access( AccessType type, uintptr_t addr, size_t length );
 
+   // Access every line in [addr, addr+length), e.g. for REP string
+   // operations. Returns true only if all lines hit.
+   bool accessRange( AccessType type, uintptr_t addr, size_t length );
+
    unsigned int lineSize() const { return _lineSize; }
+   unsigned int id()       const { return _id; }
+
+   // Estimate stall cycles with model, or not at all if it is null
+   void setLatencyModel( const LatencyModel* model ) { _latency = model; }
+
+   // Called by the directory to downgrade the copy at (set, way) at once
+   void downgrade( unsigned int set, unsigned int way, CacheState newState, bool safe );
+
+   // Called by the directory instead of downgrade() when downgrades are
+   // deferred (DirectorySet::setDeferredDowngrades). The message is queued
+   // and only applied by drain(), from the owning thread.
+   void post( DowngradeMessage* msg ) { _mailbox.push( msg ); }
 
-   void downgrade( uintptr_t addr, CacheState newState, bool safe );
+   // Apply queued downgrades in the order they were posted. Every access
+   // drains first; otherwise only call this while the owning thread is not
+   // accessing the cache, e.g. before a report or snapshot.
+   void drain();
 
    // Statistics interface
    unsigned long int accesses()          const { return _misses+_hits+_partialHits; }
+   unsigned long int hits()              const { return _hits; }
+   unsigned long int partialHits()       const { return _partialHits; }
+   unsigned long int misses()            const { return _misses; }
+   unsigned long int safeAccesses()      const { return _safeAccesses; }
    float             hitRate()           const { return static_cast<float>(_hits)/accesses(); }
    float             safeRate()          const { return static_cast<float>(_safeAccesses)/accesses(); }
    unsigned long int multilineAccesses() const { return _multilineAccesses; }
    unsigned long int downgrades()        const { return _downgrades; }
    unsigned long int rscFlushes()        const { return _rscFlush; }
+   unsigned long int stallCycles()       const { return _stallCycles; }
 
    const std::map<uintptr_t, unsigned long int>& downgradeCount() const { return _downgradeCount; }
    std::multimap<unsigned long int,uintptr_t> downgradeMap( unsigned int count = 5 ) const;
 
+   // Estimated stall cycles per line, only for lines that caused
+   // invalidations or RSC flushes
+   const std::map<uintptr_t, unsigned long int>& stallCount() const { return _stallCount; }
+   std::multimap<unsigned long int,uintptr_t> stallMap( unsigned int count = 5 ) const;
+
+   // Debug interface: report the state of the line holding addr, if present
+   bool probe( uintptr_t addr, CacheState* state, bool* safe ) const;
+
+   // Checkpoint interface. The cache must be drained before save().
+   // restore() fails if the snapshot was taken with a different geometry.
+   // Directory back-references are not part of the snapshot; the directory
+   // re-attaches its sharers when it is restored. attach() rejects a
+   // location that is out of range, invalid, already attached or that does
+   // not hold the line at addr, and reports the state of the copy.
+   void save( CheckpointWriter& writer ) const;
+   bool restore( CheckpointReader& reader );
+   bool attach( uintptr_t addr, unsigned int set, unsigned int way, DirectoryEntry* entry, CacheState* state );
+
+   // True once every valid line has been re-attached
+   bool allAttached() const;
+
 private:
+   bool _access( AccessType type,
+                 uintptr_t addr,
+                 size_t length,
+                 unsigned int set,
+                 uintptr_t tag );
+
+   bool _accessLine( AccessType type,
+                     uintptr_t addr,
+                     unsigned int set,
+                     uintptr_t tag,
+                     Directory*& home );
+
+   Directory& _home( const CacheLine& line ) const;
+
+   void _downgrade( DowngradeMessage* msg );
+   void _applyDowngrade( unsigned int set, CacheLine* targetLine, CacheState newState, bool safe );
+
    void _updateLru( unsigned int set, CacheLine* usedLine );
    void _updateLru( unsigned int set, unsigned int usedWay );
    
    CacheLine* _find( unsigned int set, uintptr_t tag ) const;
 
+
 private:
+   unsigned int _id;
+
    unsigned int _sets;
    unsigned int _lineSize;
    unsigned int _assoc;
@@ -85,6 +184,10 @@ private:
 
    DirectorySet* _directorySet;
 
+   Mailbox<DowngradeMessage> _mailbox;
+
+   const LatencyModel* _latency;
+
    unsigned long int _misses;
    unsigned long int _hits;
    unsigned long int _partialHits;
@@ -93,8 +196,10 @@ private:
    unsigned long int _multilineAccesses;
    unsigned long int _downgrades;
    unsigned long int _rscFlush;
+   unsigned long int _stallCycles;
 
    std::map<uintptr_t,unsigned long int> _downgradeCount;
+   std::map<uintptr_t,unsigned long int> _stallCount;
 };
 
 #endif // !CACHE_H
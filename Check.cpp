@@ -0,0 +1,670 @@
+// Differential checker: runs the frozen reference model (RefModel.cpp) in
+// lockstep with the engine in Cache.cpp/Directory.cpp on random and
+// adversarial synthetic access streams, and stops at the first access where
+// hit/miss results, counters, line states or directory entries diverge.
+
+#include "Cache.h"
+#include "Directory.h"
+#include "RefModel.h"
+#include "Checkpoint.h"
+#include "Latency.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const uintptr_t BASE_ADDR = 0x7f0000000000;
+const unsigned int CHECK_INTERVAL = 256;
+
+// The engine runs with stall estimation on, which must not change any
+// result the reference produces
+static LatencyModel checkLatency()
+{
+   LatencyModel model;
+   model.siteHop.push_back( 20 );
+   model.siteHop.push_back( 80 );
+   return model;
+}
+static const LatencyModel latencyModel = checkLatency();
+
+struct Access
+{
+   uintptr_t    addr;
+   unsigned int length;
+   unsigned int tid;
+   bool         store;
+   bool         range;
+};
+
+typedef vector<Access> Trace;
+
+struct Scenario
+{
+   const char*  name;
+   size_t       cacheSize;
+   size_t       lineSize;
+   unsigned int assoc;
+   unsigned int numCaches;
+   unsigned int numSites;
+   Trace (*generate)( mt19937_64& rng, size_t n, size_t lineSize );
+};
+
+static Access makeAccess( uintptr_t addr, unsigned int length, unsigned int tid, bool store )
+{
+   Access a;
+   a.addr   = addr;
+   a.length = length;
+   a.tid    = tid;
+   a.store  = store;
+   a.range  = false;
+   return a;
+}
+
+// Random accesses over a few pages with random widths and alignment
+static Trace randomTrace( mt19937_64& rng, size_t n, size_t lineSize )
+{
+   static const unsigned int lengths[] = { 1, 2, 4, 8, 16, 32, 64 };
+   Trace t;
+   for( size_t i = 0; i < n; ++i )
+   {
+      uintptr_t addr = BASE_ADDR + rng() % (16*4096);
+      t.push_back( makeAccess(addr, lengths[rng() % 7], rng() % 4, rng() % 10 < 4) );
+   }
+   return t;
+}
+
+// Many lines mapping to the same set to force evictions of shared lines
+static Trace conflictTrace( mt19937_64& rng, size_t n, size_t lineSize )
+{
+   Trace t;
+   for( size_t i = 0; i < n; ++i )
+   {
+      uintptr_t addr = BASE_ADDR + (rng() % 12) * 8*KILO + (rng() % 2) * lineSize + (rng() % lineSize);
+      t.push_back( makeAccess(addr, 1, rng() % 4, rng() % 3 == 0) );
+   }
+   return t;
+}
+
+// A handful of lines bounced between all caches
+static Trace pingPongTrace( mt19937_64& rng, size_t n, size_t lineSize )
+{
+   Trace t;
+   for( size_t i = 0; i < n; ++i )
+   {
+      uintptr_t addr = BASE_ADDR + (rng() % 3) * lineSize + (rng() % (lineSize/8)) * 8;
+      t.push_back( makeAccess(addr, 8, rng() % 4, rng() % 2 == 0) );
+   }
+   return t;
+}
+
+// Long unaligned accesses crossing line and page boundaries
+static Trace multiLineTrace( mt19937_64& rng, size_t n, size_t lineSize )
+{
+   Trace t;
+   for( size_t i = 0; i < n; ++i )
+   {
+      uintptr_t addr = BASE_ADDR + 4096 - 3*lineSize + rng() % (8*lineSize);
+      unsigned int length = 1 + rng() % (6*lineSize);
+      t.push_back( makeAccess(addr, length, rng() % 3, rng() % 3 == 0) );
+   }
+   return t;
+}
+
+// String-operation style ranges, larger than the cache, mixed with
+// ordinary accesses
+static Trace rangeTrace( mt19937_64& rng, size_t n, size_t lineSize )
+{
+   Trace t;
+   for( size_t i = 0; i < n; ++i )
+   {
+      uintptr_t addr = BASE_ADDR + rng() % (4*4096);
+      if( rng() % 4 == 0 )
+      {
+         Access a = makeAccess( addr, 1 + rng() % (3*4096), rng() % 3, rng() % 2 == 0 );
+         a.range = true;
+         t.push_back( a );
+      }
+      else
+      {
+         t.push_back( makeAccess(addr, 8, rng() % 3, rng() % 3 == 0) );
+      }
+   }
+   return t;
+}
+
+// Bursts of accesses from one cache at a time, as buffered per-thread
+// instrumentation would deliver them
+static Trace burstTrace( mt19937_64& rng, size_t n, size_t lineSize )
+{
+   Trace t;
+   while( t.size() < n )
+   {
+      unsigned int tid = rng() % 4;
+      size_t burst = 1 + rng() % 80;
+      for( size_t i = 0; i < burst && t.size() < n; ++i )
+      {
+         uintptr_t addr = BASE_ADDR + rng() % (8*4096);
+         t.push_back( makeAccess(addr, 1 + rng() % 16, tid, rng() % 4 == 0) );
+      }
+   }
+   return t;
+}
+
+static const Scenario scenarios[] =
+{
+   { "random",    4*KILO, 64, 2, 4, 2, randomTrace },
+   { "random-dm", 2*KILO, 64, 1, 4, 3, randomTrace },
+   { "conflict",  1*KILO, 64, 2, 4, 2, conflictTrace },
+   { "pingpong",  1*KILO, 64, 4, 4, 1, pingPongTrace },
+   { "multiline", 2*KILO, 32, 2, 3, 2, multiLineTrace },
+   { "range",     2*KILO, 64, 2, 3, 2, rangeTrace },
+   { "burst",     2*KILO, 64, 2, 4, 2, burstTrace },
+};
+
+static const char* stateName( CacheState s )
+{
+   switch( s )
+   {
+   case Invalid:   return "I";
+   case Shared:    return "S";
+   case Exclusive: return "E";
+   case Modified:  return "M";
+   }
+   return "?";
+}
+
+template <typename C>
+static int cacheIndex( const vector<C*>& caches, const C* c )
+{
+   auto it = find( caches.begin(), caches.end(), c );
+   return (it == caches.end()) ? -1 : static_cast<int>(it - caches.begin());
+}
+
+// Describe everything both models know about one line, with caches
+// identified by index so the two models can be compared textually. If only
+// is not negative, the other caches' copies are left out.
+template <typename C, typename DS, typename Info>
+static string dumpLine( const vector<C*>& caches, const DS& directorySet, uintptr_t line, int only = -1 )
+{
+   ostringstream out;
+   out << hex << line << dec << ":";
+
+   for( unsigned int i = 0; i < caches.size(); ++i )
+   {
+      if( only >= 0 && static_cast<int>(i) != only )
+         continue;
+
+      CacheState state;
+      bool safe;
+      if( caches[i]->probe(line, &state, &safe) )
+         out << " c" << i << "=" << stateName(state) << (safe ? "/safe" : "/unsafe");
+   }
+
+   Info info;
+   if( directorySet.probe(line, &info) )
+   {
+      out << " | dir modified=" << info.modified
+          << " owner=" << cacheIndex( caches, info.owner )
+          << " readOnly=" << info.readOnly
+          << " shared=" << info.shared
+          << " sharers=[";
+      for( unsigned int i = 0; i < info.caches.size(); ++i )
+         out << (i ? " " : "") << cacheIndex( caches, info.caches[i] );
+      out << "]";
+   }
+   else
+   {
+      out << " | dir -";
+   }
+
+   return out.str();
+}
+
+// extraMultiline is added to each cache's multiline count, to account for
+// ranges the reference model replays as one access per line
+template <typename C>
+static string dumpCounters( const vector<C*>& caches, const vector<unsigned long int>& extraMultiline, int only = -1 )
+{
+   ostringstream out;
+   for( unsigned int i = 0; i < caches.size(); ++i )
+   {
+      if( only >= 0 && static_cast<int>(i) != only )
+         continue;
+
+      const C& c = *caches[i];
+      out << "c" << i
+          << " hits=" << c.hits()
+          << " partial=" << c.partialHits()
+          << " misses=" << c.misses()
+          << " safe=" << c.safeAccesses()
+          << " multiline=" << c.multilineAccesses() + extraMultiline[i]
+          << " downgrades=" << c.downgrades()
+          << " rsc=" << c.rscFlushes()
+          << endl;
+   }
+   return out.str();
+}
+
+template <typename C>
+static string dumpDowngradeCounts( const vector<C*>& caches )
+{
+   ostringstream out;
+   for( unsigned int i = 0; i < caches.size(); ++i )
+   {
+      const auto& dc = caches[i]->downgradeCount();
+      for( auto it = dc.begin(); it != dc.end(); ++it )
+         out << "c" << i << " " << hex << it->first << dec << " " << it->second << endl;
+   }
+   return out.str();
+}
+
+class Checker
+{
+public:
+   Checker( const Scenario& scenario, bool reverse, bool deferred )
+    : _scenario(scenario),
+      _refDirectorySet(scenario.numSites, scenario.lineSize),
+      _directorySet(new DirectorySet(scenario.numSites, scenario.lineSize)),
+      _reverse(reverse),
+      _deferred(deferred),
+      _refExtraMultiline(scenario.numCaches, 0),
+      _noExtraMultiline(scenario.numCaches, 0)
+   {
+      _refDirectorySet.setAllowReverseTransition( reverse );
+      _directorySet->setAllowReverseTransition( reverse );
+      _directorySet->setDeferredDowngrades( deferred );
+      _directorySet->setLatencyModel( &latencyModel );
+
+      for( unsigned int i = 0; i < scenario.numCaches; ++i )
+      {
+         _refCaches.push_back( new ref::Cache(scenario.cacheSize, scenario.lineSize, scenario.assoc, &_refDirectorySet) );
+         _caches.push_back( new Cache(scenario.cacheSize, scenario.lineSize, scenario.assoc, _directorySet) );
+      }
+   }
+
+   ~Checker()
+   {
+      for( unsigned int i = 0; i < _caches.size(); ++i )
+      {
+         delete _refCaches[i];
+         delete _caches[i];
+      }
+      delete _directorySet;
+   }
+
+   // Returns the index of the first diverging access, or trace.size()
+   size_t run( const Trace& trace )
+   {
+      for( size_t i = 0; i < trace.size(); ++i )
+      {
+         // Continue the second half from a snapshot of the engine
+         if( i == trace.size() / 2 && !_roundTrip() )
+         {
+            cout << "Snapshot restore failed at access " << i << endl;
+            return i;
+         }
+
+         const Access& a = trace[i];
+         bool refHit, hit;
+         _runAccess( a, &refHit, &hit );
+
+         vector<uintptr_t> lines;
+         uintptr_t first = a.addr & ~(_scenario.lineSize - 1);
+         for( uintptr_t line = first; line < a.addr + a.length; line += _scenario.lineSize )
+         {
+            lines.push_back( line );
+            _touched.insert( line );
+         }
+
+         ostringstream why;
+         if( refHit != hit )
+            why << "access " << i << " returned " << hit << ", reference returned " << refHit << endl;
+
+         // With deferred downgrades, other caches only apply them when they
+         // next access, so until then only the accessing cache is comparable
+         _compareLines( lines, why, a.tid );
+         _compareCounters( why, a.tid );
+
+         if( why.str().empty() && ((i + 1) % CHECK_INTERVAL == 0 || i + 1 == trace.size()) )
+         {
+            _directorySet->drainAll();
+            _compareCounters( why );
+            _compareAll( why );
+         }
+
+         if( !why.str().empty() )
+         {
+            cout << "Divergence at access " << i << endl
+                 << "  cache " << a.tid
+                 << (a.store ? " store " : " load ") << (a.range ? "range " : "") << hex << a.addr << dec
+                 << " length " << a.length << endl;
+            cout << why.str();
+            _directorySet->drainAll();
+            _dumpLines( lines );
+            return i;
+         }
+      }
+
+      return trace.size();
+   }
+
+private:
+   // Run a through both models
+   void _runAccess( const Access& a, bool* refHit, bool* hit )
+   {
+      if( a.range )
+      {
+         *refHit = _refAccessRange( a );
+         *hit    = _caches[a.tid]->accessRange( a.store ? Cache::Store : Cache::Load, a.addr, a.length );
+      }
+      else
+      {
+         *refHit = _refCaches[a.tid]->access( a.store ? ref::Cache::Store : ref::Cache::Load, a.addr, a.length );
+         *hit    = _caches[a.tid]->access( a.store ? Cache::Store : Cache::Load, a.addr, a.length );
+      }
+   }
+
+   // Replace the engine with one restored from a snapshot of itself
+   bool _roundTrip()
+   {
+      ostringstream snapshot;
+      CheckpointWriter writer( snapshot );
+      _directorySet->drainAll();
+      if( !_directorySet->save(writer) )
+         return false;
+
+      string data = snapshot.str();
+      CheckpointReader reader( data.data(), data.size() );
+
+      DirectorySet* directorySet = new DirectorySet( _scenario.numSites, _scenario.lineSize );
+      directorySet->setAllowReverseTransition( _reverse );
+      directorySet->setDeferredDowngrades( _deferred );
+      directorySet->setLatencyModel( &latencyModel );
+
+      vector<Cache*> caches;
+      bool ok = directorySet->restore( reader, &caches ) && caches.size() == _caches.size();
+
+      for( unsigned int i = 0; ok && i < caches.size(); ++i )
+      {
+         ok = caches[i]->stallCycles() == _caches[i]->stallCycles() &&
+              caches[i]->stallCount() == _caches[i]->stallCount();
+      }
+
+      for( unsigned int i = 0; i < _caches.size(); ++i )
+         delete _caches[i];
+      delete _directorySet;
+
+      _caches = caches;
+      _directorySet = directorySet;
+      return ok;
+   }
+
+   // The reference has no range API, so replay it one line at a time
+   bool _refAccessRange( const Access& a )
+   {
+      bool hit = true;
+      uintptr_t addr = a.addr;
+      uintptr_t end  = a.addr + a.length;
+      while( addr < end )
+      {
+         uintptr_t next = (addr & ~(_scenario.lineSize - 1)) + _scenario.lineSize;
+         size_t length = min( next, end ) - addr;
+         hit = _refCaches[a.tid]->access( a.store ? ref::Cache::Store : ref::Cache::Load, addr, length ) && hit;
+         if( next < end )
+            ++_refExtraMultiline[a.tid];
+         addr = next;
+      }
+      return hit;
+   }
+
+   void _compareLines( const vector<uintptr_t>& lines, ostream& why, int only = -1 ) const
+   {
+      for( auto it = lines.begin(); it != lines.end(); ++it )
+      {
+         string refLine = dumpLine<ref::Cache, ref::DirectorySet, ref::DirectoryEntryInfo>( _refCaches, _refDirectorySet, *it, only );
+         string line    = dumpLine<Cache, DirectorySet, DirectoryEntryInfo>( _caches, *_directorySet, *it, only );
+         if( refLine != line )
+            why << "line state differs" << endl
+                << "  reference: " << refLine << endl
+                << "  engine:    " << line << endl;
+      }
+   }
+
+   void _dumpLines( const vector<uintptr_t>& lines ) const
+   {
+      cout << "state of accessed lines:" << endl;
+      for( auto it = lines.begin(); it != lines.end(); ++it )
+      {
+         cout << "  reference: " << dumpLine<ref::Cache, ref::DirectorySet, ref::DirectoryEntryInfo>( _refCaches, _refDirectorySet, *it ) << endl
+              << "  engine:    " << dumpLine<Cache, DirectorySet, DirectoryEntryInfo>( _caches, *_directorySet, *it ) << endl;
+      }
+   }
+
+   void _compareCounters( ostream& why, int only = -1 ) const
+   {
+      string refCounters = dumpCounters( _refCaches, _refExtraMultiline, only );
+      string counters    = dumpCounters( _caches, _noExtraMultiline, only );
+      if( refCounters != counters )
+         why << "counters differ" << endl
+             << "reference:" << endl << refCounters
+             << "engine:" << endl << counters;
+   }
+
+   // Full comparison of every line seen so far plus the aggregate reports
+   void _compareAll( ostream& why ) const
+   {
+      vector<uintptr_t> lines( _touched.begin(), _touched.end() );
+      _compareLines( lines, why );
+
+      if( dumpDowngradeCounts(_refCaches) != dumpDowngradeCounts(_caches) )
+         why << "per-line downgrade counts differ" << endl;
+
+      ostringstream refStats, stats;
+      _refDirectorySet.printStats( refStats );
+      _directorySet->printStats( stats );
+      if( refStats.str() != stats.str() )
+         why << "directory classification differs" << endl
+             << "reference:" << endl << refStats.str()
+             << "engine:" << endl << stats.str();
+   }
+
+private:
+   const Scenario& _scenario;
+
+   ref::DirectorySet _refDirectorySet;
+   DirectorySet*     _directorySet;
+   bool              _reverse;
+   bool              _deferred;
+
+   vector<ref::Cache*> _refCaches;
+   vector<Cache*>      _caches;
+
+   vector<unsigned long int> _refExtraMultiline;
+   vector<unsigned long int> _noExtraMultiline;
+
+   set<uintptr_t> _touched;
+};
+
+// Stall estimation on a short fixed sequence, against hand-computed
+// costs. Lines X and Y are on the first and second page touched, so they
+// are homed on sites 0 and 1.
+static bool checkLatencyArithmetic( bool deferred )
+{
+   LatencyModel model;
+   model.hit          = 4;
+   model.invalidation = 30;
+   model.rscFlush     = 200;
+   model.siteHop.push_back( 10 );
+   model.siteHop.push_back( 50 );
+
+   const unsigned int lineSize = 64;
+   DirectorySet directorySet( 2, lineSize );
+   directorySet.setDeferredDowngrades( deferred );
+   directorySet.setLatencyModel( &model );
+
+   vector<Cache*> caches;
+   for( unsigned int i = 0; i < 3; ++i )
+      caches.push_back( new Cache(4*KILO, lineSize, 2, &directorySet) );
+
+   const uintptr_t x = BASE_ADDR;
+   const uintptr_t y = BASE_ADDR + 4*KILO;
+
+   caches[0]->access( Cache::Load,  x, 8 );   // c0: hop 10
+   caches[0]->access( Cache::Load,  x, 8 );   // c0: hit 4
+   caches[1]->access( Cache::Load,  x, 8 );   // c1: hop 10 + 1 downgrade, line stays safe
+   caches[2]->access( Cache::Store, x, 8 );   // c2: hop 10 + 2 invalidations, c0 and c1 flush
+   caches[1]->access( Cache::Load,  y, 8 );   // c1: hop 50 on site 1
+   directorySet.drainAll();
+
+   map<uintptr_t, unsigned long int> expectedCount[3];
+   expectedCount[0][x / lineSize] = 200;
+   expectedCount[1][x / lineSize] = 40 + 200;
+   expectedCount[2][x / lineSize] = 70;
+   const unsigned long int expectedCycles[3] = { 10 + 4 + 200, 40 + 200 + 50, 70 };
+
+   bool ok = true;
+   for( unsigned int i = 0; i < caches.size(); ++i )
+   {
+      if( caches[i]->stallCycles() != expectedCycles[i] || caches[i]->stallCount() != expectedCount[i] )
+      {
+         cout << "Latency mismatch for cache " << i << (deferred ? " with deferred downgrades" : "")
+              << ": " << caches[i]->stallCycles() << " stall cycles, expected " << expectedCycles[i] << endl;
+         ok = false;
+      }
+   }
+
+   for( unsigned int i = 0; i < caches.size(); ++i )
+      delete caches[i];
+   return ok;
+}
+
+// Restore snapshots with a few random bit flips. Each must either be
+// rejected or restore to a model that keeps running without tripping its
+// assertions. Returns the number that were rejected.
+static unsigned int checkCorruptSnapshots( unsigned int seeds, size_t n )
+{
+   const Scenario& scenario = scenarios[0];
+   mt19937_64 rng( 1 );
+   Trace trace = scenario.generate( rng, n, scenario.lineSize );
+
+   string data;
+   {
+      DirectorySet directorySet( scenario.numSites, scenario.lineSize );
+      vector<Cache*> caches;
+      for( unsigned int i = 0; i < scenario.numCaches; ++i )
+         caches.push_back( new Cache(scenario.cacheSize, scenario.lineSize, scenario.assoc, &directorySet) );
+
+      for( auto it = trace.begin(); it != trace.end(); ++it )
+         caches[it->tid]->access( it->store ? Cache::Store : Cache::Load, it->addr, it->length );
+
+      // Leave a hole in the cache ids
+      delete caches.back();
+      caches.pop_back();
+
+      ostringstream snapshot;
+      CheckpointWriter writer( snapshot );
+      bool saved = directorySet.save( writer );
+      assert( saved );
+      (void)saved;
+      data = snapshot.str();
+
+      for( unsigned int i = 0; i < caches.size(); ++i )
+         delete caches[i];
+   }
+
+   unsigned int rejected = 0;
+   for( unsigned int seed = 1; seed <= seeds; ++seed )
+   {
+      mt19937_64 flips( seed );
+      string corrupt = data;
+      for( int i = 0; i < 4; ++i )
+      {
+         size_t bit = flips() % (corrupt.size() * 8);
+         corrupt[bit / 8] ^= static_cast<char>( 1 << (bit % 8) );
+      }
+
+      DirectorySet directorySet( scenario.numSites, scenario.lineSize );
+      vector<Cache*> caches;
+      CheckpointReader reader( corrupt.data(), corrupt.size() );
+      if( !directorySet.restore(reader, &caches) )
+         ++rejected;
+      else
+      {
+         for( auto it = trace.begin(); it != trace.end(); ++it )
+         {
+            if( it->tid < caches.size() && caches[it->tid] != nullptr )
+               caches[it->tid]->access( it->store ? Cache::Store : Cache::Load, it->addr, it->length );
+         }
+      }
+
+      for( unsigned int i = 0; i < caches.size(); ++i )
+         delete caches[i];
+   }
+   return rejected;
+}
+
+int main( int argc, char* argv[] )
+{
+   size_t n = 20000;
+   unsigned int seeds = 4;
+
+   for( int i = 1; i < argc; ++i )
+   {
+      if( strcmp(argv[i], "-n") == 0 && i+1 < argc )
+         n = strtoul( argv[++i], nullptr, 0 );
+      else if( strcmp(argv[i], "-s") == 0 && i+1 < argc )
+         seeds = strtoul( argv[++i], nullptr, 0 );
+      else
+      {
+         cerr << "Usage: " << argv[0] << " [-n accesses] [-s seeds]" << endl;
+         return -1;
+      }
+   }
+
+   unsigned int runs = 0;
+   for( const Scenario& scenario : scenarios )
+   {
+      for( unsigned int seed = 1; seed <= seeds; ++seed )
+      {
+         for( int reverse = 0; reverse < 2; ++reverse )
+         {
+            for( int deferred = 0; deferred < 2; ++deferred )
+            {
+               mt19937_64 rng( seed );
+               Trace trace = scenario.generate( rng, n, scenario.lineSize );
+
+               Checker checker( scenario, reverse, deferred );
+               if( checker.run(trace) != trace.size() )
+               {
+                  cout << "FAILED: scenario " << scenario.name << " seed " << seed
+                       << (reverse ? " with" : " without") << " reverse transitions"
+                       << (deferred ? ", deferred downgrades" : "") << endl;
+                  return 1;
+               }
+               ++runs;
+            }
+         }
+      }
+   }
+
+   if( !checkLatencyArithmetic(false) || !checkLatencyArithmetic(true) )
+      return 1;
+
+   const unsigned int corruptSeeds = 400;
+   unsigned int rejected = checkCorruptSnapshots( corruptSeeds, n );
+   cout << "Corrupt snapshots: " << rejected << " of " << corruptSeeds << " rejected, the rest restored and replayed" << endl;
+
+   cout << "OK: " << runs << " runs of " << n << " accesses match the reference model" << endl;
+   return 0;
+}
@@ -0,0 +1,34 @@
+#include "Checkpoint.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+CheckpointFile::CheckpointFile( const char* path )
+ : _data(nullptr),
+   _size(0)
+{
+   int fd = open( path, O_RDONLY );
+   if( fd < 0 )
+      return;
+
+   struct stat st;
+   if( fstat(fd, &st) == 0 && st.st_size > 0 )
+   {
+      void* p = mmap( nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+      if( p != MAP_FAILED )
+      {
+         _data = p;
+         _size = st.st_size;
+      }
+   }
+
+   close( fd );
+}
+
+CheckpointFile::~CheckpointFile()
+{
+   if( _data != nullptr )
+      munmap( _data, _size );
+}
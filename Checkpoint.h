@@ -0,0 +1,85 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <iostream>
+
+const uint64_t CHECKPOINT_MAGIC   = 0x54504b4353434153ULL; // "SACSCKPT"
+const uint32_t CHECKPOINT_VERSION = 2;
+
+// Raw binary serialization for simulator snapshots. Values are stored in
+// host byte order, so snapshots are only meant to be reloaded on the same
+// kind of machine that wrote them.
+class CheckpointWriter
+{
+public:
+   CheckpointWriter( std::ostream& stream ) : _stream(stream) {}
+
+   template <typename T>
+   void put( const T& value )
+   {
+      _stream.write( reinterpret_cast<const char*>(&value), sizeof(T) );
+   }
+
+   bool good() const { return _stream.good(); }
+
+private:
+   std::ostream& _stream;
+};
+
+class CheckpointReader
+{
+public:
+   CheckpointReader( const void* data, size_t size )
+    : _data(static_cast<const char*>(data)),
+      _size(size),
+      _pos(0),
+      _ok(true)
+   {}
+
+   // Returns false, zeroes value and latches the error on reading past
+   // the end
+   template <typename T>
+   bool get( T* value )
+   {
+      if( !_ok || _size - _pos < sizeof(T) )
+      {
+         memset( value, 0, sizeof(T) );
+         _ok = false;
+         return false;
+      }
+
+      memcpy( value, _data + _pos, sizeof(T) );
+      _pos += sizeof(T);
+      return true;
+   }
+
+   bool ok()    const { return _ok; }
+   bool atEnd() const { return _pos == _size; }
+
+private:
+   const char* _data;
+   size_t      _size;
+   size_t      _pos;
+   bool        _ok;
+};
+
+// Read-only memory mapping of a snapshot file
+class CheckpointFile
+{
+public:
+   CheckpointFile( const char* path );
+   ~CheckpointFile();
+
+   bool        isOpen() const { return _data != nullptr; }
+   const void* data()   const { return _data; }
+   size_t      size()   const { return _size; }
+
+private:
+   void*  _data;
+   size_t _size;
+};
+
+#endif // !CHECKPOINT_H
@@ -1,34 +1,51 @@
 #include "Directory.h"
 #include "Util.h"
+#include "Checkpoint.h"
+#include "Latency.h"
 
 #include <cassert>
 #include <iostream>
 #include <iomanip>
+#include <tuple>
 
 using namespace std;
 
-const int PAGE_SHIFT = 12;
-const int PAGE_SIZE = (1 << PAGE_SHIFT);
-
-Directory::Directory( unsigned int lineSize )
- : _addrShift(floorLog2(lineSize)),
-   _allowReverseTransition(false)
+Directory::Directory( unsigned int site, unsigned int lineSize, const vector<Cache*>& caches )
+ : _site(site),
+   _addrShift(floorLog2(lineSize)),
+   _caches(caches),
+   _hopLatency(0),
+   _allowReverseTransition(false),
+   _deferDowngrades(false)
 {
+   _recount();
 }
 
-CacheState Directory::request( Cache* cache, 
-                               uintptr_t addr, 
-                               CacheState reqState, 
-                               bool* safe )
+Directory::~Directory()
 {
-   // Find entry, optionally creating a new one
-   DirectoryEntry& dirEntry = _dir[addr >> _addrShift];
+   for( DowngradeMessage* msg = _returned.takeAll(); msg != nullptr; msg = msg->next )
+      _free.push_back( msg );
 
-   if( dirEntry.modified )
-      assert( dirEntry.caches.size() == 1 );
+   for( auto it = _free.begin(); it != _free.end(); ++it )
+   {
+      delete *it;
+   }
+}
+
+static LineClass classify( const DirectoryEntry& entry )
+{
+   if( entry.owner == NO_OWNER )
+      return Untouched;
+   else if( !entry.shared )
+      return entry.readOnly ? PrivateRO : PrivateRW;
+   else
+      return entry.readOnly ? SharedRO : SharedRW;
+}
 
-   // Update safety state of directory
-   if( dirEntry.owner == nullptr )
+// Update safety state of directory for a request or eviction by cache
+static void updateSafety( DirectoryEntry& dirEntry, int32_t cache, CacheState reqState )
+{
+   if( dirEntry.owner == NO_OWNER )
    {
       dirEntry.owner = cache;
       dirEntry.readOnly = reqState < Modified;
@@ -38,21 +55,68 @@ CacheState Directory::request( Cache* cache,
       dirEntry.shared   = (dirEntry.owner != cache);
       dirEntry.readOnly = dirEntry.readOnly && (reqState < Modified);
    }
+}
+
+CacheState Directory::request( Cache* cache, 
+                               uintptr_t addr, 
+                               CacheState reqState, 
+                               SharerLocation loc,
+                               DirectoryEntry*& entry,
+                               bool* safe,
+                               unsigned int* sent,
+                               uint16_t* version )
+{
+   // Find entry, optionally creating a new one
+   uintptr_t key = addr >> _addrShift;
+   if( entry == nullptr )
+   {
+      // Only build a node when the line is new
+      auto it = _dir.lower_bound( key );
+      if( it == _dir.end() || it->first != key )
+      {
+         it = _dir.emplace_hint( it, piecewise_construct, forward_as_tuple(key), forward_as_tuple() );
+         it->second.site = _site;
+         ++_classCount[Untouched];
+      }
+      entry = &it->second;
+   }
+   assert( _dir.find(key) != _dir.end() && entry == &_dir.find(key)->second );
+
+   DirectoryEntry& dirEntry = *entry;
+
+   if( dirEntry.modified )
+      assert( dirEntry.caches.size() == 1 );
+
+   ++dirEntry.version;
+   if( version != nullptr )
+      *version = dirEntry.version;
+
+   LineClass before = classify( dirEntry );
+   updateSafety( dirEntry, cache->id(), reqState );
+   _reclassify( before, dirEntry );
 
    // Reduce state down to one bit
    bool isSafe = !dirEntry.shared || dirEntry.readOnly;
    if( safe != nullptr )
       *safe = isSafe;
 
+   unsigned int downgrades = 0;
+
    switch( reqState )
    {
    case Shared:
       if( dirEntry.caches.size() == 1 )
-         dirEntry.caches.front()->downgrade( addr, Shared, isSafe );
+      {
+         _downgrade( dirEntry, dirEntry.caches.front(), Shared, isSafe );
+         ++downgrades;
+      }
 
       dirEntry.modified = false;
 
-      dirEntry.caches.push_back( cache );
+      dirEntry.caches.push_back( loc );
+
+      if( sent != nullptr )
+         *sent = downgrades;
 
       if( dirEntry.caches.size() == 1 )
          return Exclusive;
@@ -66,61 +130,299 @@ CacheState Directory::request( Cache* cache,
       {
          for( auto it = dirEntry.caches.begin(); it != dirEntry.caches.end(); ++it )
          {
-            if( *it != cache )
-               (*it)->downgrade( addr, Invalid, isSafe );
+            if( it->cache != loc.cache )
+            {
+               _downgrade( dirEntry, *it, Invalid, isSafe );
+               ++downgrades;
+            }
          }
          dirEntry.caches.clear();
       }
-      dirEntry.caches.push_back( cache );
+      dirEntry.caches.push_back( loc );
       dirEntry.modified = (reqState == Modified);
+
+      if( sent != nullptr )
+         *sent = downgrades;
       return reqState;
       break;
 
-   // Invalid indicates a writeback/eviction
-   case Invalid:
-      if( dirEntry.modified )
+   default:
+      cerr << "Request for unknown state" << endl;
+      break;
+   }
+
+   if( sent != nullptr )
+      *sent = downgrades;
+   return Invalid;
+}
+
+void Directory::evict( DirectoryEntry* entry, SharerLocation loc )
+{
+   DirectoryEntry& dirEntry = *entry;
+
+   auto it = dirEntry.caches.begin();
+   while( it != dirEntry.caches.end() && it->cache != loc.cache )
+      ++it;
+
+   // The copy was already taken away by a downgrade still on its way to
+   // the cache, so there is nothing left to write back
+   if( it == dirEntry.caches.end() )
+   {
+      assert( dirEntry.inFlight.load() != 0 );
+      return;
+   }
+
+   assert( it->set == loc.set && it->way == loc.way );
+
+   LineClass before = classify( dirEntry );
+   updateSafety( dirEntry, loc.cache, Invalid );
+
+   if( dirEntry.modified )
+   {
+      assert( dirEntry.caches.size() == 1 );
+      dirEntry.modified = false;
+   }
+   dirEntry.caches.erase( it );
+
+   // Transition back to safe if no caches have a copy anymore
+   if( _allowReverseTransition && dirEntry.caches.empty() )
+   {
+      dirEntry.owner = NO_OWNER;
+      dirEntry.shared = false;
+      dirEntry.readOnly = true;
+   }
+
+   _reclassify( before, dirEntry );
+}
+
+void Directory::forget( DirectoryEntry* entry, SharerLocation loc )
+{
+   for( auto it = entry->caches.begin(); it != entry->caches.end(); ++it )
+   {
+      if( it->cache == loc.cache )
       {
-         dirEntry.modified = false;
-         dirEntry.caches.clear();
+         entry->caches.erase( it );
+         entry->modified = false;
+         break;
       }
-      else
+   }
+}
+
+void Directory::acknowledge( DowngradeMessage* msg )
+{
+   uint32_t before = msg->entry->inFlight.fetch_sub( 1, memory_order_acq_rel );
+   assert( before != 0 );
+   (void)before;
+
+   _returned.push( msg );
+}
+
+DowngradeMessage* Directory::_allocate()
+{
+   if( _free.empty() )
+   {
+      for( DowngradeMessage* msg = _returned.takeAll(); msg != nullptr; msg = msg->next )
+         _free.push_back( msg );
+
+      if( _free.empty() )
+         return new DowngradeMessage;
+   }
+
+   DowngradeMessage* msg = _free.back();
+   _free.pop_back();
+   return msg;
+}
+
+void Directory::_reclassify( LineClass before, const DirectoryEntry& entry )
+{
+   LineClass after = classify( entry );
+   if( after != before )
+   {
+      --_classCount[before];
+      ++_classCount[after];
+   }
+}
+
+// Rebuild the class counters from scratch, after a bulk change to _dir
+void Directory::_recount()
+{
+   for( int c = 0; c < NUM_LINE_CLASSES; ++c )
+   {
+      _classCount[c] = 0;
+   }
+
+   for( auto it = _dir.begin(); it != _dir.end(); ++it )
+   {
+      ++_classCount[classify(it->second)];
+   }
+}
+
+void Directory::_downgrade( DirectoryEntry& entry, SharerLocation loc, CacheState newState, bool safe )
+{
+   if( !_deferDowngrades )
+   {
+      _caches[loc.cache]->downgrade( loc.set, loc.way, newState, safe );
+      return;
+   }
+
+   DowngradeMessage* msg = _allocate();
+   msg->home     = this;
+   msg->entry    = &entry;
+   msg->set      = loc.set;
+   msg->way      = loc.way;
+   msg->newState = newState;
+   msg->safe     = safe;
+   msg->version  = entry.version;
+
+   entry.inFlight.fetch_add( 1, memory_order_relaxed );
+   _caches[loc.cache]->post( msg );
+}
+
+bool Directory::probe( uintptr_t addr, DirectoryEntryInfo* info ) const
+{
+   auto it = _dir.find( addr >> _addrShift );
+   if( it == _dir.end() )
+      return false;
+
+   const DirectoryEntry& dirEntry = it->second;
+   info->modified = dirEntry.modified;
+   info->caches.clear();
+   for( auto it = dirEntry.caches.begin(); it != dirEntry.caches.end(); ++it )
+      info->caches.push_back( _caches[it->cache] );
+   info->owner    = (dirEntry.owner == NO_OWNER) ? nullptr : _caches[dirEntry.owner];
+   info->readOnly = dirEntry.readOnly;
+   info->shared   = dirEntry.shared;
+   return true;
+}
+
+unsigned long int Directory::numInFlight() const
+{
+   unsigned long int count = 0;
+   for( auto it = _dir.begin(); it != _dir.end(); ++it )
+   {
+      if( it->second.inFlight.load(memory_order_acquire) != 0 )
+         ++count;
+   }
+   return count;
+}
+
+void Directory::save( CheckpointWriter& writer ) const
+{
+   writer.put<uint64_t>( _dir.size() );
+   for( auto it = _dir.begin(); it != _dir.end(); ++it )
+   {
+      const DirectoryEntry& dirEntry = it->second;
+      writer.put<uint64_t>( it->first );
+      writer.put<uint8_t>( dirEntry.modified );
+      writer.put<uint8_t>( dirEntry.readOnly );
+      writer.put<uint8_t>( dirEntry.shared );
+      writer.put<int32_t>( dirEntry.owner );
+
+      writer.put<uint32_t>( dirEntry.caches.size() );
+      for( auto loc = dirEntry.caches.begin(); loc != dirEntry.caches.end(); ++loc )
+         writer.put( *loc );
+   }
+}
+
+bool Directory::restore( CheckpointReader& reader )
+{
+   uint64_t count;
+   reader.get( &count );
+
+   _dir.clear();
+   for( uint64_t i = 0; i < count && reader.ok(); ++i )
+   {
+      uint64_t key;
+      uint8_t modified, readOnly, shared;
+      int32_t owner;
+      uint32_t numSharers;
+      reader.get( &key );
+      reader.get( &modified );
+      reader.get( &readOnly );
+      reader.get( &shared );
+      reader.get( &owner );
+      reader.get( &numSharers );
+
+      if( owner < NO_OWNER || owner >= static_cast<int32_t>(_caches.size()) )
+         return false;
+
+      // A modified line has exactly one copy
+      if( modified && numSharers != 1 )
+         return false;
+
+      // Entries are saved in key order, so anything else is a duplicate
+      if( !_dir.empty() && key <= _dir.rbegin()->first )
+         return false;
+
+      DirectoryEntry& dirEntry = _dir.emplace_hint( _dir.end(), piecewise_construct, forward_as_tuple(key), forward_as_tuple() )->second;
+      dirEntry.modified = modified;
+      dirEntry.readOnly = readOnly;
+      dirEntry.shared   = shared;
+      dirEntry.owner    = owner;
+      dirEntry.site     = _site;
+
+      for( uint32_t j = 0; j < numSharers && reader.ok(); ++j )
       {
+         SharerLocation loc;
+         reader.get( &loc );
+         if( !reader.ok() || loc.cache >= _caches.size() || _caches[loc.cache] == nullptr )
+            return false;
+
          for( auto it = dirEntry.caches.begin(); it != dirEntry.caches.end(); ++it )
          {
-            if( *it == cache )
-            {
-               dirEntry.caches.erase( it );
-               break;
-            }
+            if( it->cache == loc.cache )
+               return false;
          }
-      }
 
-      // Transition back to safe if no caches have a copy anymore
-      if( _allowReverseTransition && dirEntry.caches.empty() )
-      {
-         dirEntry.owner = nullptr;
-         dirEntry.shared = false;
-         dirEntry.readOnly = true;
-      }
-      return Invalid;
-      break;
+         CacheState state;
+         if( !_caches[loc.cache]->attach(static_cast<uintptr_t>(key) << _addrShift, loc.set, loc.way, &dirEntry, &state) )
+            return false;
 
-   default:
-      cerr << "Request for unknown state" << endl;
-      break;
+         // Exclusive and modified copies are the only copy, and the
+         // directory only records a line as modified once it was stored to
+         if( (state >= Exclusive && numSharers != 1) || (modified && state != Modified) )
+            return false;
+
+         dirEntry.caches.push_back( loc );
+      }
    }
 
-   return Invalid;
+   _recount();
+   return reader.ok();
 }
 
 DirectorySet::DirectorySet( unsigned int numSites, unsigned int lineSize )
+ : _latency(nullptr)
 {
+   // Site indices must fit in DirectoryEntry::site
+   assert( numSites <= 0x100 );
    for( unsigned int i = 0; i < numSites; ++i )
    {
-      _sites.push_back( new Directory(lineSize) );
+      _sites.push_back( new Directory(i, lineSize, _caches) );
+   }
+}
+
+DirectorySet::~DirectorySet()
+{
+   for( auto it = _sites.begin(); it != _sites.end(); ++it )
+   {
+      delete *it;
    }
 }
 
+unsigned int DirectorySet::addCache( Cache* cache )
+{
+   // Ids must fit in SharerLocation::cache
+   assert( _caches.size() < 0x10000 );
+   _caches.push_back( cache );
+   return _caches.size() - 1;
+}
+
+void DirectorySet::removeCache( unsigned int id )
+{
+   _caches[id] = nullptr;
+}
+
 Directory& DirectorySet::find( uintptr_t addr )
 {
    uintptr_t vpn = addr >> PAGE_SHIFT;
@@ -141,6 +443,32 @@ Directory& DirectorySet::find( uintptr_t addr )
    return *_sites[siteId];
 }
 
+bool DirectorySet::probe( uintptr_t addr, DirectoryEntryInfo* info ) const
+{
+   auto it = _pageMap.find( addr >> PAGE_SHIFT );
+   if( it == _pageMap.end() )
+      return false;
+
+   return _sites[it->second % _sites.size()]->probe( addr, info );
+}
+
+void DirectorySet::setDeferredDowngrades( bool defer )
+{
+   for( auto it = _sites.begin(); it != _sites.end(); ++it )
+   {
+      (*it)->_deferDowngrades = defer;
+   }
+}
+
+void DirectorySet::drainAll()
+{
+   for( auto it = _caches.begin(); it != _caches.end(); ++it )
+   {
+      if( *it != nullptr )
+         (*it)->drain();
+   }
+}
+
 void DirectorySet::setAllowReverseTransition( bool allow )
 {
    for( auto it = _sites.begin(); it != _sites.end(); ++it )
@@ -149,6 +477,160 @@ void DirectorySet::setAllowReverseTransition( bool allow )
    }
 }
 
+bool DirectorySet::save( CheckpointWriter& writer ) const
+{
+   // Queued downgrades are not part of the snapshot
+   for( auto it = _sites.begin(); it != _sites.end(); ++it )
+   {
+      if( (*it)->numInFlight() != 0 )
+         return false;
+   }
+
+   writer.put( CHECKPOINT_MAGIC );
+   writer.put( CHECKPOINT_VERSION );
+   writer.put<uint32_t>( _sites.size() );
+
+   writer.put<uint32_t>( _caches.size() );
+   for( auto it = _caches.begin(); it != _caches.end(); ++it )
+   {
+      // Keep ids stable for caches that have already been destroyed
+      writer.put<uint8_t>( *it != nullptr );
+      if( *it != nullptr )
+         (*it)->save( writer );
+   }
+
+   writer.put<uint64_t>( _pageMap.size() );
+   for( auto it = _pageMap.begin(); it != _pageMap.end(); ++it )
+   {
+      writer.put<uint64_t>( it->first );
+      writer.put<uint32_t>( it->second );
+   }
+
+   for( auto it = _sites.begin(); it != _sites.end(); ++it )
+   {
+      (*it)->save( writer );
+   }
+
+   return writer.good();
+}
+
+// Bounds what a corrupt snapshot can make restore() allocate per cache
+const uint64_t MAX_RESTORED_CACHE_SIZE = 256*MEGA;
+
+// Caches must use the directory's line size, and ways must fit in
+// SharerLocation::way. isPowerOf2() also accepts 0, so rule that out first.
+static bool validGeometry( uint32_t sets, uint32_t lineSize, uint32_t assoc, uint32_t dirLineSize )
+{
+   if( sets == 0 || assoc == 0 || assoc > 0xFFFF || lineSize != dirLineSize )
+      return false;
+
+   if( static_cast<uint64_t>(sets)*lineSize*assoc > MAX_RESTORED_CACHE_SIZE )
+      return false;
+
+   return isPowerOf2( sets );
+}
+
+bool DirectorySet::restore( CheckpointReader& reader, vector<Cache*>* caches )
+{
+   assert( _caches.empty() );
+
+   uint64_t magic;
+   uint32_t version, numSites, numCaches;
+   reader.get( &magic );
+   reader.get( &version );
+   reader.get( &numSites );
+   if( !reader.ok() || magic != CHECKPOINT_MAGIC || version != CHECKPOINT_VERSION || numSites != _sites.size() )
+      return false;
+
+   // Ids must fit in SharerLocation::cache
+   reader.get( &numCaches );
+   if( !reader.ok() || numCaches > 0x10000 )
+      return false;
+
+   for( uint32_t i = 0; i < numCaches && reader.ok(); ++i )
+   {
+      uint8_t present;
+      reader.get( &present );
+      if( !present )
+      {
+         _caches.push_back( nullptr );
+         caches->push_back( nullptr );
+         continue;
+      }
+
+      // Peek at the geometry so the cache can be built to match
+      CheckpointReader peek = reader;
+      uint32_t sets, lineSize, assoc;
+      peek.get( &sets );
+      peek.get( &lineSize );
+      peek.get( &assoc );
+      if( !peek.ok() || !validGeometry(sets, lineSize, assoc, 1u << _sites.front()->_addrShift) )
+         return false;
+
+      Cache* cache = new Cache( static_cast<size_t>(sets)*lineSize*assoc, lineSize, assoc, this );
+      caches->push_back( cache );
+      if( !cache->restore(reader) )
+         return false;
+   }
+
+   uint64_t numPages;
+   reader.get( &numPages );
+   _pageMap.clear();
+   for( uint64_t i = 0; i < numPages && reader.ok(); ++i )
+   {
+      uint64_t vpn;
+      uint32_t ppn;
+      reader.get( &vpn );
+      reader.get( &ppn );
+      if( !_pageMap.empty() && vpn <= _pageMap.rbegin()->first )
+         return false;
+
+      _pageMap.emplace_hint( _pageMap.end(), vpn, ppn );
+   }
+
+   for( auto it = _sites.begin(); it != _sites.end() && reader.ok(); ++it )
+   {
+      if( !(*it)->restore(reader) )
+         return false;
+   }
+
+   // Every line must be homed where its page maps to
+   for( unsigned int i = 0; i < _sites.size(); ++i )
+   {
+      const Directory& site = *_sites[i];
+      for( auto it = site._dir.begin(); it != site._dir.end(); ++it )
+      {
+         auto page = _pageMap.find( (static_cast<uintptr_t>(it->first) << site._addrShift) >> PAGE_SHIFT );
+         if( page == _pageMap.end() || page->second % _sites.size() != i )
+            return false;
+      }
+   }
+
+   for( auto it = _caches.begin(); it != _caches.end(); ++it )
+   {
+      if( *it != nullptr && !(*it)->allAttached() )
+         return false;
+   }
+
+   return reader.ok() && reader.atEnd();
+}
+
+void DirectorySet::setLatencyModel( const LatencyModel* model )
+{
+   _latency = model;
+
+   for( unsigned int i = 0; i < _sites.size(); ++i )
+   {
+      _sites[i]->_hopLatency = model ? model->hop(i) : 0;
+   }
+
+   for( auto it = _caches.begin(); it != _caches.end(); ++it )
+   {
+      if( *it != nullptr )
+         (*it)->setLatencyModel( model );
+   }
+}
+
 void DirectorySet::printStats( ostream& stream ) const
 {
    int numLinesTotal = 0;
@@ -171,33 +653,14 @@ void DirectorySet::printStats( ostream& stream ) const
    {
       stream << "Site " << i;
 
-      int numLines = _sites[i]->_dir.size();
-      int untouched = 0;
-      int p_ro = 0;
-      int p_rw = 0;
-      int s_ro = 0;
-      int s_rw = 0;
+      const Directory& site = *_sites[i];
 
-      for( auto it = _sites[i]->_dir.begin(); it != _sites[i]->_dir.end(); ++it )
-      {
-         auto& entry = it->second;
-         if( entry.owner == nullptr )
-            ++untouched;
-         else if( !entry.shared )
-         {
-            if( entry.readOnly )
-               ++p_ro;
-            else
-               ++p_rw;
-         }
-         else
-         {
-            if( entry.readOnly )
-               ++s_ro;
-            else
-               ++s_rw;
-         }
-      }
+      int numLines = site.numLines();
+      int untouched = site.classCount( Untouched );
+      int p_ro = site.classCount( PrivateRO );
+      int p_rw = site.classCount( PrivateRW );
+      int s_ro = site.classCount( SharedRO );
+      int s_rw = site.classCount( SharedRW );
 
       stream << setw(16) << numLines
              << setw(10) << 100.0*untouched/numLines << "%"
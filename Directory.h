@@ -5,59 +5,225 @@
 
 #include <vector>
 #include <map>
+#include <atomic>
 #include <stdint.h>
 #include <iostream>
 
+// Granularity at which lines are assigned to home sites
+const int PAGE_SHIFT = 12;
+const int PAGE_SIZE = (1 << PAGE_SHIFT);
+
+// Where a sharer holds its copy of a line
+struct SharerLocation
+{
+   uint16_t cache;   // Cache::id()
+   uint16_t way;
+   uint32_t set;
+};
+
+const int32_t NO_OWNER = -1;
+
+struct DirectoryEntry
+{
+   DirectoryEntry()
+    : modified(false),
+      owner(NO_OWNER),
+      readOnly(true),
+      shared(false),
+      site(0),
+      version(0),
+      inFlight(0)
+   {}
+
+   bool modified;
+   std::vector<SharerLocation> caches;
+
+   // Cache::id() of the first cache to touch the line. Kept as an id so it
+   // stays meaningful after that cache has been destroyed.
+   int32_t owner;
+   bool readOnly;
+   bool shared;
+
+   // Index of the home site in its DirectorySet
+   uint8_t site;
+
+   // Bumped by every request. Copies and downgrades carry the version they
+   // were made at, so a cache can tell a downgrade meant for an older copy.
+   // Compared modulo 2^16, which is far more requests than can be made to
+   // one line while a downgrade for it is queued.
+   uint16_t version;
+
+   // Downgrades posted to caches that they have not applied yet. A sharer
+   // is dropped from caches as soon as its message is posted, so while this
+   // is non-zero a cache may still evict a copy that is no longer listed.
+   // Decremented by the caches as they drain.
+   std::atomic<uint32_t> inFlight;
+};
+
+// Safety classification of a line, as reported by DirectorySet::printStats
+enum LineClass
+{
+   Untouched,
+   PrivateRO,
+   PrivateRW,
+   SharedRO,
+   SharedRW,
+   NUM_LINE_CLASSES
+};
+
+// Read-only copy of a directory entry, for debugging and checking
+struct DirectoryEntryInfo
+{
+   bool modified;
+   std::vector<const Cache*> caches;
+
+   const Cache* owner;   // nullptr if untouched or the owner is destroyed
+   bool readOnly;
+   bool shared;
+};
+
+// A home site. Its operations must be serialized by the caller, except
+// acknowledge(), which caches call from their owning threads while they
+// drain deferred downgrades.
 class Directory
 {
    friend class DirectorySet;
 public:
-   Directory( unsigned int lineSize );
-
+   Directory( unsigned int site, unsigned int lineSize, const std::vector<Cache*>& caches );
+   ~Directory();
+
+   // Request reqState for the line at addr, which the requester will hold
+   // at loc. entry is the requester's back-reference to the directory
+   // entry: if non-null it is used instead of a lookup, otherwise it is
+   // filled in. sent receives the number of downgrades sent to other caches
+   // and version the entry version the copy is granted at.
    CacheState request( Cache* cache, 
                        uintptr_t addr, 
                        CacheState reqState, 
-                       bool* safe = nullptr );
+                       SharerLocation loc,
+                       DirectoryEntry*& entry,
+                       bool* safe = nullptr,
+                       unsigned int* sent = nullptr,
+                       uint16_t* version = nullptr );
+
+   // Writeback/eviction of the copy held at loc
+   void evict( DirectoryEntry* entry, SharerLocation loc );
+
+   // Drop the copy held at loc from the sharers of entry without counting
+   // it as an eviction, for a cache that is being destroyed
+   void forget( DirectoryEntry* entry, SharerLocation loc );
+
+   // Called by a cache, from its owning thread, once it has applied or
+   // dropped msg. The message is returned to this site for reuse.
+   void acknowledge( DowngradeMessage* msg );
+
+   bool probe( uintptr_t addr, DirectoryEntryInfo* info ) const;
+
+   // Cycles for a round trip to this site
+   unsigned int hopLatency() const { return _hopLatency; }
+
+   // Kept up to date on every transition, so cheap to read at any time
+   unsigned long int numLines()                 const { return _dir.size(); }
+   unsigned long int classCount( LineClass c ) const { return _classCount[c]; }
+
+   // Number of lines with downgrades still in flight
+   unsigned long int numInFlight() const;
+
+   void save( CheckpointWriter& writer ) const;
+   bool restore( CheckpointReader& reader );
 
 private:
+   void _downgrade( DirectoryEntry& entry, SharerLocation loc, CacheState newState, bool safe );
+
+   DowngradeMessage* _allocate();
+
+   void _reclassify( LineClass before, const DirectoryEntry& entry );
+   void _recount();
+
+private:
+   uint8_t _site;
+
    unsigned int _addrShift;
 
-   struct DirectoryEntry
-   {
-      DirectoryEntry() 
-       : modified(false), 
-         owner(nullptr),
-         readOnly(true),
-         shared(false)
-      {}
-
-      bool modified;
-      std::vector<Cache*> caches;
-
-      Cache* owner;
-      bool readOnly;
-      bool shared;
-   };
    std::map<uintptr_t,DirectoryEntry> _dir;
 
+   // Cache ids to caches, owned by the DirectorySet
+   const std::vector<Cache*>& _caches;
+
+   unsigned int _hopLatency;
+
+   // Messages handed back by caches, and those ready for reuse. Only the
+   // serialized side of the site takes from _returned, so it has one consumer.
+   Mailbox<DowngradeMessage>      _returned;
+   std::vector<DowngradeMessage*> _free;
+
+   unsigned long int _classCount[NUM_LINE_CLASSES];
+
    bool _allowReverseTransition;
+   bool _deferDowngrades;
 };
 
+// Like Directory, calls must be serialized by the caller
 class DirectorySet
 {
 public:
    DirectorySet( unsigned int numSites, unsigned int lineSize );
+   ~DirectorySet();
+
+   // Register a cache and return its id
+   unsigned int addCache( Cache* cache );
+   void removeCache( unsigned int id );
 
    // Return the Directory that is the homesite for the given addr
    Directory& find( uintptr_t addr );
 
+   // Look up the directory entry for addr without allocating a home site
+   bool probe( uintptr_t addr, DirectoryEntryInfo* info ) const;
+
    void setAllowReverseTransition( bool allow );
 
+   // Post downgrades to the caches' mailboxes instead of applying them at
+   // once. Each cache then applies its own downgrades when it next
+   // accesses. Off by default: every request still goes through the
+   // caller's lock, so deferring only adds a message round trip. Calls
+   // must stay serialized in this mode too: a cache drains before each
+   // access, and only the lock keeps a downgrade from being posted between
+   // that drain and a store hitting the Exclusive copy it names.
+   void setDeferredDowngrades( bool defer );
+
+   // Applies to all sites and to caches registered now or later. The model
+   // must outlive the DirectorySet.
+   void setLatencyModel( const LatencyModel* model );
+   const LatencyModel* latencyModel() const { return _latency; }
+
+   unsigned int numSites() const { return _sites.size(); }
+   const Directory& site( unsigned int i ) const { return *_sites[i]; }
+   Directory&       site( unsigned int i )       { return *_sites[i]; }
+
+   // Apply every cache's queued downgrades. Only call this while no cache
+   // is being accessed, e.g. before a snapshot or the final report.
+   void drainAll();
+
    void printStats( std::ostream& stream = std::cout ) const;
 
+   // Snapshot of all registered caches, the page map and every site.
+   // Fails without writing anything if downgrades are still in flight, so
+   // drain all caches first. Also returns false if the writer failed.
+   // restore() must be called on a DirectorySet with no caches yet; it
+   // creates the caches and returns them indexed by id, with nullptr for
+   // caches that had been destroyed before the snapshot. It fails on a
+   // snapshot whose geometry, sharers, line states or page homes do not
+   // agree with each other.
+   bool save( CheckpointWriter& writer ) const;
+   bool restore( CheckpointReader& reader, std::vector<Cache*>* caches );
+
 private:
+   std::vector<Cache*> _caches;
+
    std::vector<Directory*> _sites;
 
+   const LatencyModel* _latency;
+
    std::map<uintptr_t,unsigned int> _pageMap;
 };
 
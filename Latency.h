@@ -0,0 +1,36 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <vector>
+
+// Cycle costs used to estimate the time threads lose to the memory system
+struct LatencyModel
+{
+   LatencyModel()
+    : hit(4),
+      invalidation(30),
+      rscFlush(200)
+   {}
+
+   // Charged for every line access that hits
+   unsigned int hit;
+
+   // Round trip to the home site serving a directory request, indexed by
+   // site id. Sites past the end of the list use the last value.
+   std::vector<unsigned int> siteHop;
+
+   // Per downgrade or invalidation the home site has to send
+   unsigned int invalidation;
+
+   // Charged to the cache whose safe line is made unsafe
+   unsigned int rscFlush;
+
+   unsigned int hop( unsigned int site ) const
+   {
+      if( siteHop.empty() )
+         return 0;
+      return siteHop[site < siteHop.size() ? site : siteHop.size() - 1];
+   }
+};
+
+#endif // !LATENCY_H
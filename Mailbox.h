@@ -0,0 +1,54 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <atomic>
+
+// Unbounded lock-free multi-producer, single-consumer queue of intrusive
+// nodes. T must have a T* member named next. Any thread may push; only the
+// owner may take. Producers push onto a stack and the consumer takes the
+// whole stack at once, so the consumer never races a producer for a node.
+template <typename T>
+class Mailbox
+{
+public:
+   Mailbox() : _head(nullptr) {}
+
+   void push( T* node )
+   {
+      node->next = _head.load( std::memory_order_relaxed );
+      while( !_head.compare_exchange_weak(node->next, node,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed) )
+         ;
+   }
+
+   // Remove every queued node and return them linked through next, oldest
+   // first, or nullptr if there are none. Consumer only.
+   T* takeAll()
+   {
+      T* node = _head.exchange( nullptr, std::memory_order_acquire );
+
+      T* oldest = nullptr;
+      while( node != nullptr )
+      {
+         T* next = node->next;
+         node->next = oldest;
+         oldest = node;
+         node = next;
+      }
+      return oldest;
+   }
+
+   bool empty() const
+   {
+      return _head.load( std::memory_order_relaxed ) == nullptr;
+   }
+
+private:
+   Mailbox( const Mailbox& );
+   Mailbox& operator=( const Mailbox& );
+
+   std::atomic<T*> _head;
+};
+
+#endif // !MAILBOX_H
@@ -0,0 +1,471 @@
+#include "RefModel.h"
+#include "Util.h"
+
+#include <cassert>
+#include <iostream>
+#include <iomanip>
+
+using namespace std;
+
+namespace ref
+{
+
+Cache::Cache( size_t cacheSize, 
+              size_t lineSize, 
+              unsigned int assoc, 
+              DirectorySet* directorySet )
+ : _directorySet(directorySet)
+{
+   assert( cacheSize != 0 );
+   assert( lineSize != 0 );
+   assert( isPowerOf2(lineSize) );
+   assert( assoc != 0 );
+   assert( cacheSize % (lineSize*assoc) == 0 );
+
+   _sets     = cacheSize / (lineSize*assoc);
+   _lineSize = lineSize;
+   _assoc    = assoc;
+
+   _offsetMask = _lineSize - 1;
+   _setShift   = floorLog2( _lineSize );
+   _setMask    = (_sets - 1) << _setShift;
+   _tagShift   = _setShift + floorLog2(_sets);
+   _tagMask    = ~(_setMask | _offsetMask);
+
+   _lines = new CacheLine*[_sets];
+   for( unsigned int s = 0; s < _sets; ++s )
+   {
+      _lines[s] = new CacheLine[_assoc]();
+   }
+
+   _misses      = 0;
+   _hits        = 0;
+   _partialHits = 0;
+
+   _safeAccesses = 0;
+   _multilineAccesses = 0;
+   _downgrades = 0;
+   _rscFlush = 0;
+}
+
+Cache::~Cache()
+{
+   for( unsigned int s = 0; s < _sets;  ++s )
+   {
+      delete [] _lines[s];
+   }
+
+   delete [] _lines;
+}
+
+bool Cache::access( AccessType type, uintptr_t addr, size_t length )
+{
+   // Check for hit
+   bool hit = false;
+   bool partialHit = false;
+
+   unsigned int set = (addr & _setMask) >> _setShift;
+   uintptr_t tag    = (addr & _tagMask) >> _tagShift;
+
+   CacheLine* targetLine = _find( set, tag );
+   if( targetLine != nullptr )
+   {
+      assert( targetLine->state != Invalid );
+      if( type == Store && targetLine->state < Exclusive )
+         partialHit = true;
+      else
+         hit = true;
+   }
+
+   if( hit )
+   {
+      ++_hits;
+
+      if( type == Store )
+         targetLine->state = Modified;
+
+      if( targetLine->safe )
+         ++_safeAccesses;
+   }
+   else
+   {
+      // Directory request needed for anything other than full hit
+      bool safe;
+      Directory& dir = _directorySet->find( addr );
+      CacheState reqState = (type == Load) ? Shared : Modified;
+      CacheState repState = dir.request( this, addr, reqState, &safe );
+
+      assert( repState >= reqState );
+
+      if( partialHit )
+      {
+         assert( repState == Modified );
+         targetLine->state = repState;
+         targetLine->safe  = safe;
+         ++_partialHits;
+      }
+      else
+      {
+         int lruWay = 0;
+         int lruAge = 0;
+         for( unsigned int w = 0; w < _assoc; ++w )
+         {
+            CacheLine& line = _lines[set][w];
+            if( line.state == Invalid )
+            {
+               lruWay = w;
+               break;
+            }
+
+            if( line.age > lruAge )
+            {
+               lruWay = w;
+               lruAge = line.age;
+            }
+         }
+
+         CacheLine& destLine = _lines[set][lruWay];
+         targetLine = &destLine;
+
+         // Tell directory about eviction
+         if( destLine.state != Invalid )
+         {
+            uintptr_t evictAddr = destLine.tag << _tagShift;
+            evictAddr |= set << _setShift;
+            _directorySet->find( evictAddr ).request( this, evictAddr, Invalid );
+         }
+
+         destLine.tag   = tag;
+         destLine.state = repState;
+         destLine.safe  = safe;
+
+         ++_misses;
+      }
+   }
+
+   _updateLru( set, targetLine );
+
+   // Check if more lines need to be accessed
+   uintptr_t endAddr = addr + length - 1;
+   unsigned int endSet = (endAddr & _setMask) >> _setShift;
+   if( endSet != set )
+   {
+      uintptr_t nextSetBase = (addr & ~_offsetMask) + (1 << _setShift);
+      size_t curSetLen = _lineSize - (addr & _offsetMask);
+      hit = hit && access( type, nextSetBase, length-curSetLen );
+      ++_multilineAccesses;
+   }
+
+   return hit;
+}
+
+void Cache::_updateLru( unsigned int set, CacheLine* usedLine )
+{
+   for( unsigned int w = 0; w < _assoc; ++w )
+   {
+      _lines[set][w].age += 1;
+   }
+
+   usedLine->age = 0;
+}
+
+void Cache::downgrade( uintptr_t addr, CacheState newState, bool safe )
+{
+   uintptr_t tag    = (addr & _tagMask) >> _tagShift;
+   unsigned int set = (addr & _setMask) >> _setShift;
+
+   CacheLine* targetLine = _find( set, tag );
+
+   assert( targetLine != nullptr );
+   assert( newState == Invalid || newState == Shared );
+
+   // Reactive SC flush condition
+   if( targetLine->safe && !safe )
+   {
+      ++_rscFlush;
+   }
+
+   targetLine->state = newState;
+   targetLine->safe  = safe;
+
+   ++_downgrades;
+
+   _downgradeCount[addr >> _setShift]++;
+}
+
+Cache::CacheLine* Cache::_find( unsigned int set, uintptr_t tag ) const
+{
+   for( unsigned int w = 0; w < _assoc; ++w )
+   {
+      CacheLine& line = _lines[set][w];
+      if( line.tag == tag && line.state != Invalid )
+         return &line;
+   }
+   return nullptr;
+}
+
+bool Cache::probe( uintptr_t addr, CacheState* state, bool* safe ) const
+{
+   unsigned int set = (addr & _setMask) >> _setShift;
+   uintptr_t tag    = (addr & _tagMask) >> _tagShift;
+
+   CacheLine* line = _find( set, tag );
+   if( line == nullptr )
+      return false;
+
+   *state = line->state;
+   *safe  = line->safe;
+   return true;
+}
+
+const int PAGE_SHIFT = 12;
+const int PAGE_SIZE = (1 << PAGE_SHIFT);
+
+Directory::Directory( unsigned int lineSize )
+ : _addrShift(floorLog2(lineSize)),
+   _allowReverseTransition(false)
+{
+}
+
+CacheState Directory::request( Cache* cache, 
+                               uintptr_t addr, 
+                               CacheState reqState, 
+                               bool* safe )
+{
+   // Find entry, optionally creating a new one
+   DirectoryEntry& dirEntry = _dir[addr >> _addrShift];
+
+   if( dirEntry.modified )
+      assert( dirEntry.caches.size() == 1 );
+
+   // Update safety state of directory
+   if( dirEntry.owner == nullptr )
+   {
+      dirEntry.owner = cache;
+      dirEntry.readOnly = reqState < Modified;
+   }
+   else
+   {
+      dirEntry.shared   = (dirEntry.owner != cache);
+      dirEntry.readOnly = dirEntry.readOnly && (reqState < Modified);
+   }
+
+   // Reduce state down to one bit
+   bool isSafe = !dirEntry.shared || dirEntry.readOnly;
+   if( safe != nullptr )
+      *safe = isSafe;
+
+   switch( reqState )
+   {
+   case Shared:
+      if( dirEntry.caches.size() == 1 )
+         dirEntry.caches.front()->downgrade( addr, Shared, isSafe );
+
+      dirEntry.modified = false;
+
+      dirEntry.caches.push_back( cache );
+
+      if( dirEntry.caches.size() == 1 )
+         return Exclusive;
+      else
+         return Shared;
+      break;
+
+   case Exclusive:
+   case Modified:
+      if( !dirEntry.caches.empty() )
+      {
+         for( auto it = dirEntry.caches.begin(); it != dirEntry.caches.end(); ++it )
+         {
+            if( *it != cache )
+               (*it)->downgrade( addr, Invalid, isSafe );
+         }
+         dirEntry.caches.clear();
+      }
+      dirEntry.caches.push_back( cache );
+      dirEntry.modified = (reqState == Modified);
+      return reqState;
+      break;
+
+   // Invalid indicates a writeback/eviction
+   case Invalid:
+      if( dirEntry.modified )
+      {
+         dirEntry.modified = false;
+         dirEntry.caches.clear();
+      }
+      else
+      {
+         for( auto it = dirEntry.caches.begin(); it != dirEntry.caches.end(); ++it )
+         {
+            if( *it == cache )
+            {
+               dirEntry.caches.erase( it );
+               break;
+            }
+         }
+      }
+
+      // Transition back to safe if no caches have a copy anymore
+      if( _allowReverseTransition && dirEntry.caches.empty() )
+      {
+         dirEntry.owner = nullptr;
+         dirEntry.shared = false;
+         dirEntry.readOnly = true;
+      }
+      return Invalid;
+      break;
+
+   default:
+      cerr << "Request for unknown state" << endl;
+      break;
+   }
+
+   return Invalid;
+}
+
+bool Directory::probe( uintptr_t addr, DirectoryEntryInfo* info ) const
+{
+   auto it = _dir.find( addr >> _addrShift );
+   if( it == _dir.end() )
+      return false;
+
+   const DirectoryEntry& dirEntry = it->second;
+   info->modified = dirEntry.modified;
+   info->caches.assign( dirEntry.caches.begin(), dirEntry.caches.end() );
+   info->owner    = dirEntry.owner;
+   info->readOnly = dirEntry.readOnly;
+   info->shared   = dirEntry.shared;
+   return true;
+}
+
+DirectorySet::DirectorySet( unsigned int numSites, unsigned int lineSize )
+{
+   for( unsigned int i = 0; i < numSites; ++i )
+   {
+      _sites.push_back( new Directory(lineSize) );
+   }
+}
+
+DirectorySet::~DirectorySet()
+{
+   for( auto it = _sites.begin(); it != _sites.end(); ++it )
+   {
+      delete *it;
+   }
+}
+
+Directory& DirectorySet::find( uintptr_t addr )
+{
+   uintptr_t vpn = addr >> PAGE_SHIFT;
+   unsigned int ppn;
+
+   auto it = _pageMap.find( vpn );
+
+   if( it != _pageMap.end() )
+      ppn = it->second;
+   else
+   {
+      ppn = _pageMap.size();
+      _pageMap[vpn] = ppn;
+   }
+
+   int siteId = ppn % _sites.size();
+
+   return *_sites[siteId];
+}
+
+bool DirectorySet::probe( uintptr_t addr, DirectoryEntryInfo* info ) const
+{
+   auto it = _pageMap.find( addr >> PAGE_SHIFT );
+   if( it == _pageMap.end() )
+      return false;
+
+   return _sites[it->second % _sites.size()]->probe( addr, info );
+}
+
+void DirectorySet::setAllowReverseTransition( bool allow )
+{
+   for( auto it = _sites.begin(); it != _sites.end(); ++it )
+   {
+      (*it)->_allowReverseTransition = allow;
+   }
+}
+
+void DirectorySet::printStats( ostream& stream ) const
+{
+   int numLinesTotal = 0;
+   int untouchedTotal = 0;
+   int p_roTotal = 0;
+   int p_rwTotal = 0;
+   int s_roTotal = 0;
+   int s_rwTotal = 0;
+
+   stream << setw(10) << ""
+          << setw(12) << "Unique Lines"
+          << setw(11) << "Untouched"
+          << setw(12) << "P_RO"
+          << setw(13) << "P_RW"
+          << setw(13) << "S_RO"
+          << setw(11) << "S_RW"
+          << endl;
+
+   for( unsigned int i = 0; i < _sites.size(); ++i )
+   {
+      stream << "Site " << i;
+
+      int numLines = _sites[i]->_dir.size();
+      int untouched = 0;
+      int p_ro = 0;
+      int p_rw = 0;
+      int s_ro = 0;
+      int s_rw = 0;
+
+      for( auto it = _sites[i]->_dir.begin(); it != _sites[i]->_dir.end(); ++it )
+      {
+         auto& entry = it->second;
+         if( entry.owner == nullptr )
+            ++untouched;
+         else if( !entry.shared )
+         {
+            if( entry.readOnly )
+               ++p_ro;
+            else
+               ++p_rw;
+         }
+         else
+         {
+            if( entry.readOnly )
+               ++s_ro;
+            else
+               ++s_rw;
+         }
+      }
+
+      stream << setw(16) << numLines
+             << setw(10) << 100.0*untouched/numLines << "%"
+             << setw(11) << 100.0*p_ro/numLines << "%"
+             << setw(12) << 100.0*p_rw/numLines << "%"
+             << setw(12) << 100.0*s_ro/numLines << "%"
+             << setw(10) << 100.0*s_rw/numLines << "%"
+             << endl;
+
+      numLinesTotal += numLines;
+      untouchedTotal += untouched;
+      p_roTotal += p_ro;
+      p_rwTotal += p_rw;
+      s_roTotal += s_ro;
+      s_rwTotal += s_rw;
+   }
+
+   stream << "All Sites"
+          << setw(13) << numLinesTotal
+          << setw(10) << 100.0*untouchedTotal/numLinesTotal << "%"
+          << setw(11) << 100.0*p_roTotal/numLinesTotal << "%"
+          << setw(12) << 100.0*p_rwTotal/numLinesTotal << "%"
+          << setw(12) << 100.0*s_roTotal/numLinesTotal << "%"
+          << setw(10) << 100.0*s_rwTotal/numLinesTotal << "%"
+          << endl;
+}
+
+} // namespace ref
@@ -0,0 +1,165 @@
+#ifndef REFMODEL_H
+#define REFMODEL_H
+
+// Frozen copy of the original, straightforward cache and directory model.
+// It is only used by the checker as a golden reference for the optimized
+// engine in Cache.cpp/Directory.cpp, so it must never change behavior.
+
+#include "Cache.h"
+
+#include <stdint.h>
+#include <iostream>
+#include <map>
+#include <vector>
+
+namespace ref
+{
+
+class Cache;
+class DirectorySet;
+
+struct DirectoryEntryInfo
+{
+   bool modified;
+   std::vector<const Cache*> caches;
+
+   const Cache* owner;
+   bool readOnly;
+   bool shared;
+};
+
+class Cache
+{
+public:
+   enum AccessType
+   {
+      Load,
+      Store
+   };
+
+private:
+   struct CacheLine
+   {
+      CacheLine() : tag(0), state(Invalid), age(0) {}
+
+      uintptr_t tag;
+      CacheState state;
+      int age;
+      bool safe;
+   };
+
+public:
+   Cache( size_t cacheSize,
+          size_t lineSize,
+          unsigned int assoc,
+          DirectorySet* directorySet );
+   ~Cache();
+
+   bool access( AccessType type, uintptr_t addr, size_t length );
+
+   void downgrade( uintptr_t addr, CacheState newState, bool safe );
+
+   unsigned long int hits()              const { return _hits; }
+   unsigned long int partialHits()       const { return _partialHits; }
+   unsigned long int misses()            const { return _misses; }
+   unsigned long int safeAccesses()      const { return _safeAccesses; }
+   unsigned long int multilineAccesses() const { return _multilineAccesses; }
+   unsigned long int downgrades()        const { return _downgrades; }
+   unsigned long int rscFlushes()        const { return _rscFlush; }
+
+   const std::map<uintptr_t, unsigned long int>& downgradeCount() const { return _downgradeCount; }
+
+   bool probe( uintptr_t addr, CacheState* state, bool* safe ) const;
+
+private:
+   void _updateLru( unsigned int set, CacheLine* usedLine );
+
+   CacheLine* _find( unsigned int set, uintptr_t tag ) const;
+
+private:
+   unsigned int _sets;
+   unsigned int _lineSize;
+   unsigned int _assoc;
+
+   uintptr_t _offsetMask;
+   uintptr_t _setMask;
+   int       _setShift;
+   uintptr_t _tagMask;
+   int       _tagShift;
+
+   CacheLine** _lines;
+
+   DirectorySet* _directorySet;
+
+   unsigned long int _misses;
+   unsigned long int _hits;
+   unsigned long int _partialHits;
+
+   unsigned long int _safeAccesses;
+   unsigned long int _multilineAccesses;
+   unsigned long int _downgrades;
+   unsigned long int _rscFlush;
+
+   std::map<uintptr_t,unsigned long int> _downgradeCount;
+};
+
+class Directory
+{
+   friend class DirectorySet;
+public:
+   Directory( unsigned int lineSize );
+
+   CacheState request( Cache* cache,
+                       uintptr_t addr,
+                       CacheState reqState,
+                       bool* safe = nullptr );
+
+   bool probe( uintptr_t addr, DirectoryEntryInfo* info ) const;
+
+private:
+   unsigned int _addrShift;
+
+   struct DirectoryEntry
+   {
+      DirectoryEntry()
+       : modified(false),
+         owner(nullptr),
+         readOnly(true),
+         shared(false)
+      {}
+
+      bool modified;
+      std::vector<Cache*> caches;
+
+      Cache* owner;
+      bool readOnly;
+      bool shared;
+   };
+   std::map<uintptr_t,DirectoryEntry> _dir;
+
+   bool _allowReverseTransition;
+};
+
+class DirectorySet
+{
+public:
+   DirectorySet( unsigned int numSites, unsigned int lineSize );
+   ~DirectorySet();
+
+   Directory& find( uintptr_t addr );
+
+   bool probe( uintptr_t addr, DirectoryEntryInfo* info ) const;
+
+   void setAllowReverseTransition( bool allow );
+
+   void printStats( std::ostream& stream = std::cout ) const;
+
+private:
+   std::vector<Directory*> _sites;
+
+   std::map<uintptr_t,unsigned int> _pageMap;
+};
+
+} // namespace ref
+
+#endif // !REFMODEL_H
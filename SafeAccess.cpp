@@ -1,5 +1,7 @@
 #include "Cache.h"
 #include "Directory.h"
+#include "Checkpoint.h"
+#include "Latency.h"
 
 #include "pin.H"
 
@@ -9,6 +11,7 @@
 #include <cstring>
 #include <cassert>
 #include <iomanip>
+#include <sstream>
 
 using namespace std;
 
@@ -26,6 +29,29 @@ static KNOB<string> outputFile(KNOB_MODE_WRITEONCE, "pintool",
                                "o", "safeaccess.log", "Specify output file name" );
 static KNOB<bool> allowReverse(KNOB_MODE_WRITEONCE, "pintool",
                                "r", "false", "Allow reverse transitions (unsafe to safe)" );
+static KNOB<bool> deferDowngrades(KNOB_MODE_WRITEONCE, "pintool",
+                                  "defer_downgrades", "false", "Queue downgrades until the target thread next accesses" );
+static KNOB<string> saveFile(KNOB_MODE_WRITEONCE, "pintool",
+                             "save", "", "Write a snapshot of the simulator state to this file" );
+static KNOB<UINT64> saveAfter(KNOB_MODE_WRITEONCE, "pintool",
+                              "save_after", "0", "Take the snapshot after this many accesses instead of at exit" );
+static KNOB<string> restoreFile(KNOB_MODE_WRITEONCE, "pintool",
+                                "restore", "", "Start from a snapshot written with -save" );
+static KNOB<bool> latency(KNOB_MODE_WRITEONCE, "pintool",
+                          "latency", "false", "Estimate stall cycles from coherence activity" );
+static KNOB<UINT32> latHit(KNOB_MODE_WRITEONCE, "pintool",
+                           "lat_hit", "4", "Cycles per cache hit" );
+static KNOB<UINT32> latHop(KNOB_MODE_APPEND, "pintool",
+                           "lat_hop", "60", "Cycles per directory request, one value per home site" );
+static KNOB<UINT32> latInv(KNOB_MODE_WRITEONCE, "pintool",
+                           "lat_inv", "30", "Cycles per invalidation/downgrade sent" );
+static KNOB<UINT32> latRsc(KNOB_MODE_WRITEONCE, "pintool",
+                           "lat_rsc", "200", "Cycles per RSC flush" );
+
+static LatencyModel latencyModel;
+
+static UINT64 accessCount = 0;
+static bool saved = false;
 
 int printUsage()
 {
@@ -39,11 +65,34 @@ void printIns( THREADID tid, void* v )
    cout << tid << ": " << s << endl;
 }
 
+// Caller must hold mutex, which also keeps every other thread out of its
+// cache while the queued downgrades are applied
+void saveSnapshot()
+{
+   directorySet.drainAll();
+
+   string name = saveFile.Value();
+   ofstream file( name.c_str(), ios::binary );
+   CheckpointWriter writer( file );
+   if( !directorySet.save(writer) )
+      cerr << "Failed to write snapshot " << name << endl;
+
+   saved = true;
+}
+
+// Caller must hold mutex
+inline void countAccess()
+{
+   if( ++accessCount == saveAfter.Value() && !saveFile.Value().empty() )
+      saveSnapshot();
+}
+
 void load( uintptr_t addr, unsigned int size, THREADID tid, void* v )
 {
    PIN_MutexLock( &mutex );
    //cout << tid << " L: " << size << " " << hex << addr << endl;
    caches[tid]->access( Cache::Load, addr, size );
+   countAccess();
    PIN_MutexUnlock( &mutex );
 }
 
@@ -52,9 +101,116 @@ void store( uintptr_t addr, unsigned int size, THREADID tid, void* v )
    PIN_MutexLock( &mutex );
    //cout << tid << " S: " << size << " " << hex << addr << endl;
    caches[tid]->access( Cache::Store, addr, size );
+   countAccess();
+   PIN_MutexUnlock( &mutex );
+}
+
+// Plain REP string instructions are simulated once, on the first
+// iteration, as a single range covering all iterations
+ADDRINT firstRepIteration( BOOL first )
+{
+   return first;
+}
+
+static uintptr_t repRangeStart( uintptr_t addr, unsigned int size, ADDRINT count, ADDRINT flags )
+{
+   // With the direction flag set, addresses decrease from the first element
+   const ADDRINT DF = 0x400;
+   if( flags & DF )
+      return addr - (count - 1) * size;
+   return addr;
+}
+
+void loadRange( uintptr_t addr, unsigned int size, ADDRINT count, ADDRINT flags, THREADID tid )
+{
+   if( count == 0 )
+      return;
+
+   PIN_MutexLock( &mutex );
+   caches[tid]->accessRange( Cache::Load, repRangeStart(addr, size, count, flags), count*size );
+   countAccess();
    PIN_MutexUnlock( &mutex );
 }
 
+void storeRange( uintptr_t addr, unsigned int size, ADDRINT count, ADDRINT flags, THREADID tid )
+{
+   if( count == 0 )
+      return;
+
+   PIN_MutexLock( &mutex );
+   caches[tid]->accessRange( Cache::Store, repRangeStart(addr, size, count, flags), count*size );
+   countAccess();
+   PIN_MutexUnlock( &mutex );
+}
+
+// True for REP MOVS/STOS/LODS, which always run the full count. REPE/REPNE
+// CMPS and SCAS may stop early, and a 0xF3 byte on anything else (PAUSE,
+// rep ret, mandatory SSE prefixes) is not a repeat at all. REP INS/OUTS
+// are I/O string ops and keep the per-access path.
+bool isFixedCountRep( INS ins )
+{
+   // Pin 2.x has no INS_HasRealRep() and XED 2 folds the prefix into the
+   // plain CMPSx/SCASx iclasses, so require a string op with a prefix
+   if( !(INS_RepPrefix(ins) || INS_RepnePrefix(ins)) ||
+       INS_Category(ins) != XED_CATEGORY_STRINGOP ||
+       INS_RepCountRegister(ins) == REG_INVALID() )
+      return false;
+
+   switch( INS_Opcode(ins) )
+   {
+   case XED_ICLASS_CMPSB:
+   case XED_ICLASS_CMPSW:
+   case XED_ICLASS_CMPSD:
+   case XED_ICLASS_CMPSQ:
+   case XED_ICLASS_SCASB:
+   case XED_ICLASS_SCASW:
+   case XED_ICLASS_SCASD:
+   case XED_ICLASS_SCASQ:
+      return false;
+   default:
+      return true;
+   }
+}
+
+void instrumentRep( INS ins )
+{
+   if( INS_IsMemoryRead(ins) )
+   {
+      INS_InsertIfCall( ins,
+                        IPOINT_BEFORE,
+                        reinterpret_cast<AFUNPTR>(firstRepIteration),
+                        IARG_FIRST_REP_ITERATION,
+                        IARG_END );
+      INS_InsertThenPredicatedCall( ins,
+                                    IPOINT_BEFORE,
+                                    reinterpret_cast<AFUNPTR>(loadRange),
+                                    IARG_MEMORYREAD_EA,
+                                    IARG_MEMORYREAD_SIZE,
+                                    IARG_REG_VALUE, INS_RepCountRegister(ins),
+                                    IARG_REG_VALUE, REG_GFLAGS,
+                                    IARG_THREAD_ID,
+                                    IARG_END );
+   }
+
+   if( INS_IsMemoryWrite(ins) )
+   {
+      INS_InsertIfCall( ins,
+                        IPOINT_BEFORE,
+                        reinterpret_cast<AFUNPTR>(firstRepIteration),
+                        IARG_FIRST_REP_ITERATION,
+                        IARG_END );
+      INS_InsertThenPredicatedCall( ins,
+                                    IPOINT_BEFORE,
+                                    reinterpret_cast<AFUNPTR>(storeRange),
+                                    IARG_MEMORYWRITE_EA,
+                                    IARG_MEMORYWRITE_SIZE,
+                                    IARG_REG_VALUE, INS_RepCountRegister(ins),
+                                    IARG_REG_VALUE, REG_GFLAGS,
+                                    IARG_THREAD_ID,
+                                    IARG_END );
+   }
+}
+
 void instrumentTrace( TRACE trace, void* v )
 {
    for( BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl) )
@@ -72,6 +228,12 @@ void instrumentTrace( TRACE trace, void* v )
           *                IARG_END );
           */
 
+         if( isFixedCountRep(ins) )
+         {
+            instrumentRep( ins );
+            continue;
+         }
+
          if( INS_IsMemoryRead(ins) )
          {
             INS_InsertPredicatedCall( ins, 
@@ -105,6 +267,11 @@ void addCache( unsigned int tid, CONTEXT* ctxt, int flags, void* v )
    {
       caches.resize( tid + 1, nullptr );
    }
+
+   // Threads pick up the cache of the same index from a restored snapshot
+   if( caches[tid] != nullptr )
+      return;
+
    caches[tid] = new Cache( CACHE_SIZE, 
                             CACHE_LINE_SIZE, 
                             CACHE_ASSOCIATIVITY, 
@@ -112,15 +279,58 @@ void addCache( unsigned int tid, CONTEXT* ctxt, int flags, void* v )
    //cout << "Cache " << tid << " = " << hex << caches[tid] << endl;
 }
 
+// Estimated stall cycles per cache, with the lines that cost each the most
+void printStalls( ostream& stream )
+{
+   stream << setw(8) << ""
+          << setw(15) << "Stall Cycles"
+          << endl;
+
+   unsigned long int totalStalls = 0;
+   for( unsigned int i = 0; i < caches.size(); ++i )
+   {
+      if( caches[i] == nullptr )
+         continue;
+
+      const Cache& c = *caches[i];
+      totalStalls += c.stallCycles();
+
+      stream << "Cache " << i << setw(15) << c.stallCycles();
+
+      const auto& sm = c.stallMap( 3 );
+      for( auto it = sm.rbegin(); it != sm.rend(); ++it )
+      {
+         stream << " (" << hex << it->second << " : "
+                << fixed << (100.0*it->first/c.stallCycles()) << "%)";
+      }
+      stream << dec << endl;
+   }
+
+   stream << "Totals " << setw(15) << totalStalls << endl << endl;
+}
+
 void finish( int code, void* v )
 {
-   ofstream file( outputFile.Value().c_str() );
+   // Threads that exited never drained their last downgrades
+   directorySet.drainAll();
+
+   if( !saveFile.Value().empty() && !saved )
+      saveSnapshot();
+
+   string name = outputFile.Value();
+   ofstream file( name.c_str() );
    assert( file.good() );
 
    file.precision(3);
    file << fixed;
    file << endl;
 
+   // Caches are released while printing the main table
+   ostringstream stalls;
+   stalls.precision(3);
+   if( latency.Value() )
+      printStalls( stalls );
+
    file << setw(8) << ""
         << setw(10) << "Total Accesses"
         << setw(11) << "Hit Rate" 
@@ -142,6 +352,10 @@ void finish( int code, void* v )
 
    for( unsigned int i = 0; i < caches.size(); ++i )
    {
+      // Ids restored from a snapshot may have no cache
+      if( caches[i] == nullptr )
+         continue;
+
       file << "Cache " << i;
 
       const Cache& c = *caches[i];
@@ -200,6 +414,8 @@ void finish( int code, void* v )
 
    file << dec << endl << endl;
 
+   file << stalls.str();
+
    directorySet.printStats( file );
 
    file.close();
@@ -213,6 +429,29 @@ int main(int argc, char *argv[])
       return printUsage();
 
    directorySet.setAllowReverseTransition( allowReverse.Value() );
+   directorySet.setDeferredDowngrades( deferDowngrades.Value() );
+
+   if( latency.Value() )
+   {
+      latencyModel.hit = latHit.Value();
+      latencyModel.invalidation = latInv.Value();
+      latencyModel.rscFlush = latRsc.Value();
+      for( UINT32 i = 0; i < latHop.NumberOfValues(); ++i )
+         latencyModel.siteHop.push_back( latHop.Value(i) );
+
+      directorySet.setLatencyModel( &latencyModel );
+   }
+
+   if( !restoreFile.Value().empty() )
+   {
+      CheckpointFile snapshot( restoreFile.Value().c_str() );
+      CheckpointReader reader( snapshot.data(), snapshot.size() );
+      if( !snapshot.isOpen() || !directorySet.restore(reader, &caches) )
+      {
+         cerr << "Unable to restore snapshot " << restoreFile.Value() << endl;
+         return -1;
+      }
+   }
 
    PIN_MutexInit( &mutex );
 